@@ -6,13 +6,28 @@ operation=${1:-build}
 if [ "$operation" == "build" ]; then
 	mkdir --parents build
 
+	# libpng and libwebp are only used as baselines by the benchmark
+	# procedure, which leaves out the formats whose library isn't installed.
+	optional_packages=""
+	optional_defines=""
+	if pkg-config --exists libpng; then
+		optional_packages="$optional_packages libpng"
+		optional_defines="$optional_defines -DHAVE_LIBPNG"
+	fi
+	if pkg-config --exists libwebp; then
+		optional_packages="$optional_packages libwebp"
+		optional_defines="$optional_defines -DHAVE_LIBWEBP"
+	fi
+
 	# This is more or less the same command line that gimptool-2.0 uses, except
 	# for the fact that we don't use pango.
 	cc \
 		-Wno-deprecated-declarations \
 		-O2 \
+		$optional_defines \
 		src/file-qoi.c \
-		`pkg-config --cflags --libs glib-2.0 gtk+-2.0 gimp-2.0 gimpui-2.0` \
+		`pkg-config --cflags --libs glib-2.0 gtk+-2.0 gimp-2.0 gimpui-2.0 zlib $optional_packages` \
+		-lm \
 		-o build/file-qoi
 elif [ "$operation" == "install" ]; then
 	DIR="/usr/lib/gimp/2.0/plug-ins/file-qoi"
@@ -0,0 +1,178 @@
+#!/usr/bin/env python3
+
+# Summarizes the trace lines that the plug-in writes when the QOI_TRACE
+# environment variable names a file. Pass one or more trace files, or none to
+# read from standard input:
+#
+#	QOI_TRACE=~/qoi-trace.jsonl gimp
+#	./scripts/trace_report.py ~/qoi-trace.jsonl
+#
+# For each operation the report lists latency percentiles per phase, the
+# throughput and file size for a few ranges of image sizes, the share of the
+# total time spent in each phase, the CPU events of each phase when they were
+# counted and the files that took much longer per pixel than is usual for the
+# operation.
+
+import argparse
+import collections
+import json
+import sys
+
+PHASES = ["decode", "encode", "transfer", "progress", "io", "other"]
+PERCENTILES = [50, 90, 99]
+
+# Events that file-qoi-benchmark counts per phase when it is asked to.
+COUNTERS = ["cycles", "instructions", "branch_misses", "cache_misses", "page_faults"]
+
+# Upper bounds of the ranges of image sizes, in megapixels.
+SIZE_RANGES = [0.25, 1, 4, 16, float("inf")]
+
+
+def percentile(values, p):
+	ordered = sorted(values)
+	if not ordered:
+		return 0
+	index = min(len(ordered) - 1, max(0, round(p / 100 * (len(ordered) - 1))))
+	return ordered[index]
+
+
+def read_records(files):
+	records = []
+	skipped = 0
+	for file in files:
+		for line in file:
+			line = line.strip()
+			if not line:
+				continue
+			try:
+				record = json.loads(line)
+			except json.JSONDecodeError:
+				skipped += 1
+				continue
+			if record.get("success") and record.get("total_us", 0) > 0:
+				records.append(record)
+	return records, skipped
+
+
+def print_latencies(records):
+	print("  Latency in ms")
+	print("    {:<10}".format("phase") + "".join("{:>10}".format("p{}".format(p)) for p in PERCENTILES))
+	for phase in ["total"] + PHASES:
+		values = [record.get(phase + "_us", 0) / 1000 for record in records]
+		if not any(values):
+			continue
+		print("    {:<10}".format(phase) + "".join("{:>10.2f}".format(percentile(values, p)) for p in PERCENTILES))
+
+
+def print_throughput(records):
+	print("  Throughput by image size")
+	print("    {:<14}{:>8}{:>14}{:>14}{:>16}".format("megapixels", "count", "median MP/s", "median MB/s", "bytes/pixel"))
+	lower = 0
+	for upper in SIZE_RANGES:
+		in_range = [r for r in records if lower <= r["width"] * r["height"] / 1e6 < upper]
+		if in_range:
+			megapixels = [r["width"] * r["height"] / r["total_us"] for r in in_range]
+			megabytes = [r.get("bytes", 0) / r["total_us"] for r in in_range]
+			ratios = [r.get("bytes", 0) / max(1, r["width"] * r["height"]) for r in in_range]
+			label = "{:g}+".format(lower) if upper == float("inf") else "{:g}-{:g}".format(lower, upper)
+			print("    {:<14}{:>8}{:>14.1f}{:>14.1f}{:>16.3f}".format(
+				label, len(in_range), percentile(megapixels, 50), percentile(megabytes, 50), percentile(ratios, 50)
+			))
+		lower = upper
+
+
+def print_shares(records):
+	total = sum(record["total_us"] for record in records)
+	print("  Share of time")
+	for phase in PHASES:
+		spent = sum(record.get(phase + "_us", 0) for record in records)
+		if spent:
+			print("    {:<10}{:>7.1f}%".format(phase, 100 * spent / total))
+
+
+def median_ratio(records, phase, numerator, denominator, scale):
+	ratios = []
+	for record in records:
+		top = record.get("{}_{}".format(phase, numerator)) if numerator != "pixels" else record["width"] * record["height"]
+		bottom = record.get("{}_{}".format(phase, denominator)) if denominator != "pixels" else record["width"] * record["height"]
+		if top is not None and bottom:
+			ratios.append(scale * top / bottom)
+	return "{:.2f}".format(percentile(ratios, 50)) if ratios else "-"
+
+
+# Only benchmark lines have counted events. The ratios point at what limits a
+# phase: few instructions per cycle with many cache misses means waiting on
+# memory, many branch misses per instruction means mispredicted branches.
+def print_counters(records):
+	counted = [record for record in records if any(key.endswith("_" + counter) for key in record for counter in COUNTERS)]
+	if not counted:
+		return
+
+	columns = [
+		("cycles/px", "cycles", "pixels", 1),
+		("IPC", "instructions", "cycles", 1),
+		("br-miss/kinst", "branch_misses", "instructions", 1000),
+		("c-miss/kpx", "cache_misses", "pixels", 1000),
+		("faults/MP", "page_faults", "pixels", 1e6),
+	]
+	print("  CPU events per phase (medians of {} runs)".format(len(counted)))
+	print("    {:<10}".format("phase") + "".join("{:>15}".format(column[0]) for column in columns))
+	for phase in PHASES:
+		if not any(phase + "_" + counter in record for record in counted for counter in COUNTERS):
+			continue
+		print("    {:<10}".format(phase) + "".join("{:>15}".format(median_ratio(counted, phase, *column[1:])) for column in columns))
+
+
+# A run is an outlier when it took more than factor times the median time per
+# pixel of its operation. Files are listed by how often they were outliers.
+def print_outliers(records, factor, limit):
+	costs = [record["total_us"] / max(1, record["width"] * record["height"]) for record in records]
+	median = percentile(costs, 50)
+	outliers = collections.defaultdict(list)
+	for record, cost in zip(records, costs):
+		if median and cost > factor * median:
+			outliers[record["file"]].append((cost / median, record))
+
+	if not outliers:
+		return
+
+	print("  Outliers (more than {:g}x the median time per pixel)".format(factor))
+	ordered = sorted(outliers.items(), key=lambda item: (-len(item[1]), -max(ratio for ratio, _ in item[1])))
+	for file, runs in ordered[:limit]:
+		ratio, worst = max(runs, key=lambda run: run[0])
+		slowest_phase = max(PHASES, key=lambda phase: worst.get(phase + "_us", 0))
+		print("    {} ({} runs, worst {:.1f}x at {:.1f} ms, mostly {})".format(
+			file, len(runs), ratio, worst["total_us"] / 1000, slowest_phase
+		))
+
+
+def main():
+	parser = argparse.ArgumentParser(description="Summarize the trace lines of the QOI plug-in.")
+	parser.add_argument("files", nargs="*", type=argparse.FileType("r"), help="trace files, standard input when there are none")
+	parser.add_argument("--outlier-factor", type=float, default=3, help="times the median time per pixel that makes a run an outlier")
+	parser.add_argument("--outlier-limit", type=int, default=20, help="number of outlier files to list per operation")
+	arguments = parser.parse_args()
+
+	records, skipped = read_records(arguments.files or [sys.stdin])
+	if skipped:
+		print("Skipped {} lines that are not valid JSON.".format(skipped), file=sys.stderr)
+	if not records:
+		print("No successful operations in the trace.")
+		return
+
+	operations = collections.defaultdict(list)
+	for record in records:
+		operations[record.get("operation", "unknown")].append(record)
+
+	for operation, operation_records in sorted(operations.items()):
+		print("{} ({} runs)".format(operation, len(operation_records)))
+		print_latencies(operation_records)
+		print_throughput(operation_records)
+		print_shares(operation_records)
+		print_counters(operation_records)
+		print_outliers(operation_records, arguments.outlier_factor, arguments.outlier_limit)
+		print()
+
+
+if __name__ == "__main__":
+	main()
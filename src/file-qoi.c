@@ -11,9 +11,34 @@
 
 #include <stdbool.h>
 #include <assert.h>
+#include <math.h>
+
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utime.h>
 
 #include <libgimp/gimp.h>
 #include <libgimp/gimpui.h>
+#include <glib/gstdio.h>
+
+#include <zlib.h>
+
+#ifdef HAVE_LIBPNG
+#include <png.h>
+#endif
+
+#ifdef HAVE_LIBWEBP
+#include <webp/decode.h>
+#include <webp/encode.h>
+#endif
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
 
 #define QOI_HEADER_SIZE 14
 #define QOI_END_MARKER_SIZE 8
@@ -51,12 +76,38 @@ typedef enum {
 	QOI_COLORSPACE_COUNT,
 } QoiColorspace;
 
+// How an image is turned when it is written to or read from a file. The
+// rotations are clockwise.
+typedef enum {
+	QOI_ORIENTATION_NONE = 0,
+	QOI_ORIENTATION_FLIP_HORIZONTAL,
+	QOI_ORIENTATION_FLIP_VERTICAL,
+	QOI_ORIENTATION_ROTATE_90,
+	QOI_ORIENTATION_ROTATE_180,
+	QOI_ORIENTATION_ROTATE_270,
+	QOI_ORIENTATION_COUNT,
+} QoiOrientation;
+
+// Only the pixels inside of the content rectangle are stored, one row of
+// content_width pixels after the other. Everything outside of it is fully
+// transparent, which lets a small layer on a large canvas be exported without
+// storing the empty space around it.
 typedef struct {
 	QoiPixel     *pixels;
 	guint32       width;
 	guint32       height;
+	guint32       content_x;
+	guint32       content_y;
+	guint32       content_width;
+	guint32       content_height;
 	QoiColorspace colorspace;
 	bool          has_alpha;
+
+	// Applied while the image is encoded: the file holds the image turned
+	// by orientation, with its colors premultiplied by alpha when
+	// premultiply is set. Decoded images have neither.
+	QoiOrientation orientation;
+	bool           premultiply;
 } QoiImage;
 
 typedef struct {
@@ -92,162 +143,647 @@ static inline guint qoi_pixel_hash(QoiPixel pixel) {
 	return (pixel.red * 3 + pixel.green * 5 + pixel.blue * 7 + pixel.alpha * 11) % 64;
 }
 
-// The only reason the GIMP API is used in this function is to indicate
-// progress to the user. Updating the progress for every pixel would slow down
-// loading a lot, so it is only updated when we have decoded one row of pixels.
-static bool load_image(const gchar *filename, QoiImage *result) {
-	gimp_progress_init_printf("Opening '%s'", filename);
+static inline bool qoi_orientation_swaps_sides(QoiOrientation orientation) {
+	return orientation == QOI_ORIENTATION_ROTATE_90 || orientation == QOI_ORIENTATION_ROTATE_270;
+}
 
-	gint file_size;
-	guint8 *file_data = 0;
+// Moves a rectangle of a width by height canvas to where it ends up when the
+// canvas is turned.
+static void qoi_orient_rectangle(QoiOrientation orientation, guint32 width, guint32 height, guint32 *x, guint32 *y, guint32 *rectangle_width, guint32 *rectangle_height) {
+	guint32 left   = *x;
+	guint32 top    = *y;
+	guint32 right  = width - *x - *rectangle_width;
+	guint32 bottom = height - *y - *rectangle_height;
 
-	FILE *file = fopen(filename, "rb");
-	if (!file) {
-		goto fail_without_file;
+	switch (orientation) {
+		case QOI_ORIENTATION_NONE: break;
+		case QOI_ORIENTATION_FLIP_HORIZONTAL: *x = right; break;
+		case QOI_ORIENTATION_FLIP_VERTICAL: *y = bottom; break;
+		case QOI_ORIENTATION_ROTATE_180: *x = right; *y = bottom; break;
+		case QOI_ORIENTATION_ROTATE_90: *x = bottom; *y = left; break;
+		case QOI_ORIENTATION_ROTATE_270: *x = top; *y = right; break;
+		default: assert(!"Not reached!"); break;
 	}
 
-	if (fseek(file, 0, SEEK_END) == -1) {
-		goto fail_with_file;
+	if (qoi_orientation_swaps_sides(orientation)) {
+		guint32 swap = *rectangle_width;
+		*rectangle_width = *rectangle_height;
+		*rectangle_height = swap;
 	}
+}
 
-	file_size = ftell(file);
-	if (file_size == -1) {
-		goto fail_with_file;
+// Fills row with row y of a width by height block of pixels after the block
+// has been turned. The rows of the block are stride pixels apart. Flips read
+// a single row of the block forwards or backwards and the rotations by 90
+// degrees read a single column, so the block is turned one row at a time
+// without a turned copy of all of it.
+static void qoi_orient_row(const QoiPixel *pixels, gsize stride, guint32 width, guint32 height, QoiOrientation orientation, guint32 y, QoiPixel *row) {
+	gssize  index = 0;
+	gssize  step  = 1;
+	guint32 count = width;
+
+	switch (orientation) {
+		case QOI_ORIENTATION_NONE: {
+			index = (gssize) y * stride;
+		} break;
+		case QOI_ORIENTATION_FLIP_HORIZONTAL: {
+			index = (gssize) y * stride + width - 1;
+			step  = -1;
+		} break;
+		case QOI_ORIENTATION_FLIP_VERTICAL: {
+			index = (gssize) (height - 1 - y) * stride;
+		} break;
+		case QOI_ORIENTATION_ROTATE_180: {
+			index = (gssize) (height - 1 - y) * stride + width - 1;
+			step  = -1;
+		} break;
+		case QOI_ORIENTATION_ROTATE_90: {
+			index = (gssize) (height - 1) * stride + y;
+			step  = -(gssize) stride;
+			count = height;
+		} break;
+		case QOI_ORIENTATION_ROTATE_270: {
+			index = width - 1 - y;
+			step  = stride;
+			count = height;
+		} break;
+		default: assert(!"Not reached!"); break;
 	}
-	if (fseek(file, 0, SEEK_SET) == -1) {
-		goto fail_with_file;
+
+	for (guint32 x = 0; x < count; ++x) {
+		row[x] = pixels[index];
+		index += step;
 	}
+}
 
-	file_data = g_try_malloc(file_size);
-	if (!file_data) {
-		errno = ENOMEM;
-		goto fail_with_file;
+// Rounds to the nearest value, like babl does for 8-bit samples.
+static void qoi_premultiply_row(QoiPixel *row, guint32 count) {
+	for (guint32 x = 0; x < count; ++x) {
+		guint alpha = row[x].alpha;
+		row[x].red   = (row[x].red   * alpha + 127) / 255;
+		row[x].green = (row[x].green * alpha + 127) / 255;
+		row[x].blue  = (row[x].blue  * alpha + 127) / 255;
 	}
+}
 
-	if (fread(file_data, 1, file_size, file) != file_size) {
-		g_free(file_data);
-		file_data = 0;
-		goto fail_with_file;
+// Fully transparent pixels keep their colors, as there is nothing to divide
+// them by. Colors that are brighter than their alpha allows are clamped.
+static void qoi_unpremultiply_row(QoiPixel *row, guint32 count) {
+	for (guint32 x = 0; x < count; ++x) {
+		guint alpha = row[x].alpha;
+		if (alpha == 0 || alpha == 255) {
+			continue;
+		}
+		row[x].red   = MIN(255, (row[x].red   * 255 + alpha / 2) / alpha);
+		row[x].green = MIN(255, (row[x].green * 255 + alpha / 2) / alpha);
+		row[x].blue  = MIN(255, (row[x].blue  * 255 + alpha / 2) / alpha);
 	}
+}
 
-fail_with_file:
-	// There is no point in checking for failure when closing the file as there
-	// is noting that can be done about it.
-	fclose(file);
-fail_without_file:
-	if (!file_data) {
-		g_message("Could not read from file. %s", strerror(errno));
-		return false;
+// When the QOI_TRACE environment variable names a file, every load and save
+// appends a line of JSON to it with the time spent in each phase. A trace is
+// active on the thread doing the work, and time is always counted towards
+// the phase that was entered last, so nested phases like I/O inside of
+// decoding are not counted twice. scripts/trace_report.py summarizes them.
+typedef enum {
+	QOI_PHASE_OTHER = 0,
+	QOI_PHASE_DECODE,
+	QOI_PHASE_ENCODE,
+	QOI_PHASE_TRANSFER,
+	QOI_PHASE_PROGRESS,
+	QOI_PHASE_IO,
+	QOI_PHASE_COUNT,
+} QoiPhase;
+
+static const gchar *const QOI_PHASE_NAMES[QOI_PHASE_COUNT] = {
+	[QOI_PHASE_OTHER]    = "other",
+	[QOI_PHASE_DECODE]   = "decode",
+	[QOI_PHASE_ENCODE]   = "encode",
+	[QOI_PHASE_TRANSFER] = "transfer",
+	[QOI_PHASE_PROGRESS] = "progress",
+	[QOI_PHASE_IO]       = "io",
+};
+
+// Events that the benchmark can count along with the time of each phase.
+typedef enum {
+	QOI_COUNTER_CYCLES = 0,
+	QOI_COUNTER_INSTRUCTIONS,
+	QOI_COUNTER_BRANCH_MISSES,
+	QOI_COUNTER_CACHE_MISSES,
+	QOI_COUNTER_PAGE_FAULTS,
+	QOI_COUNTER_COUNT,
+} QoiCounter;
+
+static const gchar *const QOI_COUNTER_NAMES[QOI_COUNTER_COUNT] = {
+	[QOI_COUNTER_CYCLES]        = "cycles",
+	[QOI_COUNTER_INSTRUCTIONS]  = "instructions",
+	[QOI_COUNTER_BRANCH_MISSES] = "branch_misses",
+	[QOI_COUNTER_CACHE_MISSES]  = "cache_misses",
+	[QOI_COUNTER_PAGE_FAULTS]   = "page_faults",
+};
+
+// Counters of the events on the thread that opened them, taken from
+// perf_event_open on Linux. They are opened as a single group, so all of
+// them are read with one system call. Counters that the kernel or the
+// machine doesn't support, such as the hardware counters inside of most
+// virtual machines, are left out and the rest are still counted.
+typedef struct {
+	gint group;
+	gint fds[QOI_COUNTER_COUNT];
+	gint slots[QOI_COUNTER_COUNT];
+	gint count;
+} QoiCounters;
+
+// Counters that have been initialized but not opened count nothing.
+static void qoi_counters_init(QoiCounters *counters) {
+	counters->group = -1;
+	counters->count = 0;
+	for (gint counter = 0; counter < QOI_COUNTER_COUNT; ++counter) {
+		counters->fds[counter]   = -1;
+		counters->slots[counter] = -1;
 	}
+}
 
-	gint32 file_index = 0;
-	if (file_size < file_index + QOI_HEADER_SIZE) {
-		g_message("The file ends unexpectedly.");
-		g_free(file_data);
-		return false;
+static void qoi_counters_open(QoiCounters *counters) {
+	qoi_counters_init(counters);
+
+#ifdef __linux__
+	static const struct { guint32 type; guint64 config; } events[QOI_COUNTER_COUNT] = {
+		[QOI_COUNTER_CYCLES]        = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+		[QOI_COUNTER_INSTRUCTIONS]  = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+		[QOI_COUNTER_BRANCH_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+		[QOI_COUNTER_CACHE_MISSES]  = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+		[QOI_COUNTER_PAGE_FAULTS]   = { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+	};
+
+	for (gint counter = 0; counter < QOI_COUNTER_COUNT; ++counter) {
+		struct perf_event_attr attributes = { 0 };
+		attributes.size           = sizeof(attributes);
+		attributes.type           = events[counter].type;
+		attributes.config         = events[counter].config;
+		attributes.read_format    = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		attributes.exclude_kernel = 1;
+		attributes.exclude_hv     = 1;
+
+		// The first counter that opens leads the group.
+		gint fd = syscall(SYS_perf_event_open, &attributes, 0, -1, counters->group, 0);
+		if (fd == -1) {
+			continue;
+		}
+		if (counters->group == -1) {
+			counters->group = fd;
+		}
+		counters->fds[counter]   = fd;
+		counters->slots[counter] = counters->count++;
 	}
+#endif
+}
 
-	QoiHeader header = *(QoiHeader *) &file_data[file_index];
-	file_index += QOI_HEADER_SIZE;
+static bool qoi_counters_is_open(const QoiCounters *counters, QoiCounter counter) {
+	return counters->slots[counter] != -1;
+}
 
-	if (memcmp(header.magic, "qoif", 4) != 0) {
-		g_message("'%s' is not a valid QOI file.", filename);
-		g_free(file_data);
+// A reading of the counters as the kernel reports them. When there are more
+// groups than the machine has counters for, the kernel takes turns counting
+// them and the group only runs for part of the time it is enabled.
+typedef struct {
+	guint64 enabled;
+	guint64 running;
+	guint64 values[QOI_COUNTER_COUNT];
+} QoiCounterReading;
+
+// Counters that are not open read as 0.
+static bool qoi_counters_read(const QoiCounters *counters, QoiCounterReading *reading) {
+	// The number of counters, the time enabled, the time running and then
+	// one value per counter.
+	guint64 group[3 + QOI_COUNTER_COUNT] = { 0 };
+	if (counters->group == -1 || read(counters->group, group, sizeof(group)) < (gssize) (3 * sizeof(guint64))) {
 		return false;
 	}
 
-	switch (header.channels) {
-		case QOI_CHANNELS_RGB: result->has_alpha = false; break;
-		case QOI_CHANNELS_RGBA: result->has_alpha = true; break;
-		default: {
-			g_message("Unsupported or unknown number of channels: %u.", header.channels);
-			g_free(file_data);
-			return false;
-		} break;
+	reading->enabled = group[1];
+	reading->running = group[2];
+	for (gint counter = 0; counter < QOI_COUNTER_COUNT; ++counter) {
+		gint slot = counters->slots[counter];
+		reading->values[counter] = slot == -1 || (guint64) slot >= group[0] ? 0 : group[3 + slot];
 	}
+	return true;
+}
 
-	switch (header.colorspace) {
-		case QOI_COLORSPACE_SRGB: break;
-		case QOI_COLORSPACE_LINEAR: break;
-		default: {
-			g_message("Unsupported or unknown colorspace: %u.", header.colorspace);
-			g_free(file_data);
-			return false;
-		} break;
+// The events counted between two readings, scaled up to the whole time the
+// group was enabled in between, like perf does. Only the difference of the
+// raw counts is scaled, as the share of time the group runs changes between
+// readings and the scaled totals don't always grow.
+static void qoi_counters_difference(const QoiCounterReading *since, const QoiCounterReading *now, guint64 values[QOI_COUNTER_COUNT]) {
+	guint64 enabled = now->enabled - since->enabled;
+	guint64 running = now->running - since->running;
+	for (gint counter = 0; counter < QOI_COUNTER_COUNT; ++counter) {
+		guint64 count = now->values[counter] - since->values[counter];
+		if (running == 0) {
+			values[counter] = 0;
+		} else if (running < enabled) {
+			values[counter] = (guint64) ((gdouble) count * enabled / running);
+		} else {
+			values[counter] = count;
+		}
 	}
-	result->colorspace = header.colorspace;
+}
 
-	result->width = guint32_swap_local_and_big_endian(header.width);
-	result->height = guint32_swap_local_and_big_endian(header.height);
+static void qoi_counters_close(QoiCounters *counters) {
+	for (gint counter = 0; counter < QOI_COUNTER_COUNT; ++counter) {
+		if (counters->fds[counter] != -1) {
+			close(counters->fds[counter]);
+		}
+		counters->fds[counter]   = -1;
+		counters->slots[counter] = -1;
+	}
+	counters->group = -1;
+	counters->count = 0;
+}
 
-	if (result->width == 0 || result->width > GIMP_MAX_IMAGE_SIZE) {
-		g_message("Invalid or unsupported width: %u.", header.width);
-		g_free(file_data);
+typedef struct {
+	gint64   start;
+	gint64   since;
+	QoiPhase phase;
+	gint64   phases[QOI_PHASE_COUNT];
+
+	// When counters are set, the events they count are added up per phase
+	// the same way as the time is.
+	const QoiCounters *counters;
+	QoiCounterReading  counters_since;
+	guint64            phase_counters[QOI_PHASE_COUNT][QOI_COUNTER_COUNT];
+} QoiTrace;
+
+static GPrivate active_trace = G_PRIVATE_INIT(0);
+
+static bool qoi_trace_is_enabled(void) {
+	const gchar *path = g_getenv("QOI_TRACE");
+	return path && path[0] != '\0';
+}
+
+static void qoi_trace_begin(QoiTrace *trace) {
+	*trace = (QoiTrace) { 0 };
+	trace->start = g_get_monotonic_time();
+	trace->since = trace->start;
+}
+
+// Makes the trace active on the calling thread, or none when trace is 0. A
+// trace can move between threads, such as from the thread fetching the pixels
+// of a batch export to the one saving them.
+static void qoi_trace_activate(QoiTrace *trace) {
+	if (trace) {
+		trace->since = g_get_monotonic_time();
+		if (trace->counters) {
+			qoi_counters_read(trace->counters, &trace->counters_since);
+		}
+	}
+	g_private_set(&active_trace, trace);
+}
+
+// Counts the events of counters towards the phases of the trace from now on.
+// Counters only count the thread that opened them, so the trace has to stay
+// on that thread.
+static void qoi_trace_count(QoiTrace *trace, const QoiCounters *counters) {
+	if (qoi_counters_read(counters, &trace->counters_since)) {
+		trace->counters = counters;
+	}
+}
+
+// Adds everything since the last call to the current phase.
+static void qoi_trace_charge(QoiTrace *trace) {
+	gint64 now = g_get_monotonic_time();
+	trace->phases[trace->phase] += now - trace->since;
+	trace->since = now;
+
+	QoiCounterReading reading;
+	if (trace->counters && qoi_counters_read(trace->counters, &reading)) {
+		guint64 values[QOI_COUNTER_COUNT];
+		qoi_counters_difference(&trace->counters_since, &reading, values);
+		for (gint counter = 0; counter < QOI_COUNTER_COUNT; ++counter) {
+			trace->phase_counters[trace->phase][counter] += values[counter];
+		}
+		trace->counters_since = reading;
+	}
+}
+
+// Returns the phase that was entered before, to be entered again once this
+// phase is over.
+static QoiPhase qoi_trace_enter(QoiPhase phase) {
+	QoiTrace *trace = g_private_get(&active_trace);
+	if (!trace) {
+		return phase;
+	}
+
+	QoiPhase previous = trace->phase;
+	qoi_trace_charge(trace);
+	trace->phase = phase;
+	return previous;
+}
+
+static void qoi_trace_append_json_string(GString *line, const gchar *value) {
+	g_string_append_c(line, '"');
+	for (const gchar *c = value; *c; ++c) {
+		if (*c == '"' || *c == '\\') {
+			g_string_append_c(line, '\\');
+			g_string_append_c(line, *c);
+		} else if ((guchar) *c < 0x20) {
+			g_string_append_printf(line, "\\u%04x", (guchar) *c);
+		} else {
+			g_string_append_c(line, *c);
+		}
+	}
+	g_string_append_c(line, '"');
+}
+
+// Stops counting time towards the trace.
+static void qoi_trace_end(QoiTrace *trace) {
+	qoi_trace_charge(trace);
+}
+
+static gint64 qoi_trace_total(const QoiTrace *trace) {
+	return trace->since - trace->start;
+}
+
+static void qoi_trace_append_json(GString *lines, const QoiTrace *trace, const gchar *operation, const gchar *filename, guint32 width, guint32 height, guint64 bytes, bool success) {
+	g_string_append(lines, "{\"operation\":");
+	qoi_trace_append_json_string(lines, operation);
+	g_string_append(lines, ",\"file\":");
+	qoi_trace_append_json_string(lines, filename);
+	g_string_append_printf(
+		lines,
+		",\"width\":%u,\"height\":%u,\"bytes\":%" G_GUINT64_FORMAT ",\"success\":%s,\"time\":%" G_GINT64_FORMAT ",\"total_us\":%" G_GINT64_FORMAT,
+		width, height, bytes, success ? "true" : "false", g_get_real_time() / G_USEC_PER_SEC, qoi_trace_total(trace)
+	);
+	for (gint phase = 0; phase < QOI_PHASE_COUNT; ++phase) {
+		g_string_append_printf(lines, ",\"%s_us\":%" G_GINT64_FORMAT, QOI_PHASE_NAMES[phase], trace->phases[phase]);
+	}
+
+	// Counted events are only listed for the phases that took any time.
+	for (gint phase = 0; trace->counters && phase < QOI_PHASE_COUNT; ++phase) {
+		for (gint counter = 0; counter < QOI_COUNTER_COUNT && trace->phases[phase] != 0; ++counter) {
+			if (qoi_counters_is_open(trace->counters, counter)) {
+				g_string_append_printf(
+					lines, ",\"%s_%s\":%" G_GUINT64_FORMAT,
+					QOI_PHASE_NAMES[phase], QOI_COUNTER_NAMES[counter], trace->phase_counters[phase][counter]
+				);
+			}
+		}
+	}
+	g_string_append(lines, "}\n");
+}
+
+// Lines are appended with a single write to a file opened for appending, so
+// lines from several plug-in processes and threads don't interleave.
+static void qoi_trace_finish(QoiTrace *trace, const gchar *operation, const gchar *filename, guint32 width, guint32 height, bool success) {
+	qoi_trace_end(trace);
+
+	struct stat file_stat;
+	guint64     bytes = stat(filename, &file_stat) == 0 ? (guint64) file_stat.st_size : 0;
+
+	GString *line = g_string_new(0);
+	qoi_trace_append_json(line, trace, operation, filename, width, height, bytes, success);
+
+	gint fd = g_open(g_getenv("QOI_TRACE"), O_WRONLY | O_APPEND | O_CREAT, 0666);
+	if (fd != -1) {
+		if (write(fd, line->str, line->len) != (gssize) line->len) {
+			g_warning("Could not write to the trace file.");
+		}
+		close(fd);
+	}
+	g_string_free(line, true);
+}
+
+// Progress is reported to GIMP over the plug-in protocol, which is traced as
+// a phase of its own.
+static void qoi_progress_update(gdouble fraction) {
+	QoiPhase previous = qoi_trace_enter(QOI_PHASE_PROGRESS);
+	gimp_progress_update(fraction);
+	qoi_trace_enter(previous);
+}
+
+#define QOI_MAX_PALETTE_SIZE 256
+#define QOI_PALETTE_TABLE_SIZE 512
+
+// Information about the pixels that the decoder collects while decoding them.
+// Everything in here has to be cheap enough to not slow down loading.
+typedef struct {
+	// Bounding box of the pixels that are not fully transparent, inclusive.
+	// It is only tracked for images with alpha, for images without it stays
+	// empty. The box is empty when min_x > max_x.
+	guint32 min_x;
+	guint32 min_y;
+	guint32 max_x;
+	guint32 max_y;
+
+	// Whether red, green and blue are the same for every pixel.
+	bool     is_gray;
+
+	// Whether there are pixels that are neither opaque nor fully transparent.
+	bool     has_partial_alpha;
+
+	// The colors of the image without alpha, as long as there are no more
+	// than QOI_MAX_PALETTE_SIZE of them. Once there are more, color_count
+	// is larger than QOI_MAX_PALETTE_SIZE and the palette is not updated.
+	guint32  color_count;
+	QoiPixel palette[QOI_MAX_PALETTE_SIZE];
+
+	// Open addressing table from color to 1 + the index of the color in the
+	// palette, 0 for empty slots.
+	guint16  palette_table[QOI_PALETTE_TABLE_SIZE];
+} QoiDecodeStats;
+
+// Adds every pixel from (first_x, first_y) to (last_x, last_y) in decoding
+// order to the bounding box. If they span more than one row, some of them
+// will be in the first and last columns.
+static inline void qoi_decode_stats_add_span(QoiDecodeStats *stats, guint32 width, guint32 first_x, guint32 first_y, guint32 last_x, guint32 last_y) {
+	if (first_y != last_y) {
+		first_x = 0;
+		last_x  = width - 1;
+	}
+
+	if (first_x < stats->min_x) stats->min_x = first_x;
+	if (last_x  > stats->max_x) stats->max_x = last_x;
+	if (first_y < stats->min_y) stats->min_y = first_y;
+	if (last_y  > stats->max_y) stats->max_y = last_y;
+}
+
+// Same weights as qoi_pixel_hash but without alpha, and with enough bits for
+// the palette table.
+static inline guint qoi_palette_hash(QoiPixel pixel) {
+	return (pixel.red * 3 + pixel.green * 5 + pixel.blue * 7) % QOI_PALETTE_TABLE_SIZE;
+}
+
+// Returns the index of the color in the palette, or -1 if it isn't in it.
+static inline gint qoi_decode_stats_find_color(const QoiDecodeStats *stats, QoiPixel pixel, guint *slot) {
+	*slot = qoi_palette_hash(pixel);
+	while (stats->palette_table[*slot] != 0) {
+		QoiPixel color = stats->palette[stats->palette_table[*slot] - 1];
+		if (color.red == pixel.red && color.green == pixel.green && color.blue == pixel.blue) {
+			return stats->palette_table[*slot] - 1;
+		}
+		*slot = (*slot + 1) % QOI_PALETTE_TABLE_SIZE;
+	}
+	return -1;
+}
+
+// Checks stats that weren't collected by this run of the plug-in, so that
+// the bounding box stays inside of the image and every lookup in the palette
+// table ends.
+static bool qoi_decode_stats_is_valid(const QoiDecodeStats *stats, guint32 width, guint32 height) {
+	bool is_empty = stats->min_x > stats->max_x;
+	if (!is_empty && (stats->max_x >= width || stats->min_y > stats->max_y || stats->max_y >= height)) {
 		return false;
 	}
 
-	if (result->height == 0 || result->height > GIMP_MAX_IMAGE_SIZE) {
-		g_message("Invalid or unsupported height: %u.", header.height);
-		g_free(file_data);
+	if (stats->color_count > QOI_MAX_PALETTE_SIZE + 1) {
 		return false;
 	}
 
-	result->pixels = g_try_malloc(result->width * result->height * sizeof(*result->pixels));
-	if (!result->pixels) {
-		g_message("Failed to acquire storage for pixels.");
-		g_free(file_data);
-		return false;
-	}
-
-	guint32 pixel_index     = 0;
-	guint32 column_index    = 0;
-	guint64 pixel_count     = result->width * result->height;
-	QoiPixel current_pixel  = { .alpha = 255 };
-	QoiPixel array[64]      = { 0 };
-	while (pixel_index < pixel_count) {
-		// Make sure there enough file data for the end marker, as that means
-		// there is enough data for any of the chunks as well.
-		if (file_size < file_index + QOI_END_MARKER_SIZE) {
-			g_message("The file ends unexpectedly.");
-			g_free(result->pixels);
-			g_free(file_data);
+	guint32 palette_size = MIN(stats->color_count, QOI_MAX_PALETTE_SIZE);
+	guint32 used_slots   = 0;
+	for (guint slot = 0; slot < QOI_PALETTE_TABLE_SIZE; ++slot) {
+		if (stats->palette_table[slot] > palette_size) {
 			return false;
 		}
+		used_slots += stats->palette_table[slot] != 0;
+	}
+	return used_slots <= palette_size;
+}
+
+static inline void qoi_decode_stats_add_color(QoiDecodeStats *stats, QoiPixel pixel) {
+	if (pixel.red != pixel.green || pixel.green != pixel.blue) {
+		stats->is_gray = false;
+	}
+
+	if (pixel.alpha != 0 && pixel.alpha != 255) {
+		stats->has_partial_alpha = true;
+	}
+
+	if (stats->color_count <= QOI_MAX_PALETTE_SIZE) {
+		guint slot;
+		if (qoi_decode_stats_find_color(stats, pixel, &slot) == -1) {
+			if (stats->color_count < QOI_MAX_PALETTE_SIZE) {
+				stats->palette[stats->color_count] = (QoiPixel) { pixel.red, pixel.green, pixel.blue, 255 };
+				stats->palette_table[slot] = stats->color_count + 1;
+			}
+			++stats->color_count;
+		}
+	}
+}
+
+// Decoder state that persists between calls, so that file data can be handed
+// to the decoder in pieces and pixels can be taken out of it in pieces.
+typedef struct {
+	guint32         width;
+	bool            has_alpha;
+	QoiPixel        current_pixel;
+	QoiPixel        array[64];
+
+	// Pixels of the last run that didn't fit in the pixels that were asked
+	// for. They are written first on the next call.
+	guint32         run;
+
+	// Position in the image of the next chunk, only tracked when there are
+	// stats to collect.
+	guint32         column_index;
+	guint32         row_index;
+	QoiDecodeStats *stats;
+} QoiDecoder;
+
+static void qoi_decoder_begin(QoiDecoder *decoder, guint32 width, bool has_alpha, QoiDecodeStats *stats) {
+	*decoder = (QoiDecoder) {
+		.width         = width,
+		.has_alpha     = has_alpha,
+		.current_pixel = { .alpha = 255 },
+		.stats         = stats,
+	};
+
+	if (stats) {
+		memset(stats, 0, sizeof(*stats));
+		stats->min_x   = G_MAXUINT32;
+		stats->min_y   = G_MAXUINT32;
+		stats->is_gray = true;
+	}
+}
+
+// Every pixel of a chunk has the same color, so one check covers all of them.
+// Only chunks that can produce a color that hasn't been seen before need to
+// be checked against the palette. Those are the chunks that don't take their
+// color from the index or the previous pixel, and the chunks that take the
+// color the index or the previous pixel starts out with.
+static inline void qoi_decoder_track_chunk(QoiDecoder *decoder, guint32 length, bool may_be_new) {
+	QoiDecodeStats *stats = decoder->stats;
+	if (!stats) {
+		return;
+	}
+
+	guint32 chunk_column = decoder->column_index;
+	decoder->column_index += length;
+
+	QoiPixel current_pixel = decoder->current_pixel;
+	if (may_be_new) {
+		qoi_decode_stats_add_color(stats, current_pixel);
+	}
+
+	if (decoder->has_alpha && current_pixel.alpha != 0) {
+		guint32 last_column = decoder->column_index - 1;
+		if (last_column < decoder->width) {
+			qoi_decode_stats_add_span(stats, decoder->width, chunk_column, decoder->row_index, last_column, decoder->row_index);
+		} else {
+			qoi_decode_stats_add_span(
+				stats, decoder->width,
+				chunk_column, decoder->row_index,
+				last_column % decoder->width, decoder->row_index + last_column / decoder->width
+			);
+		}
+	}
 
-		guint8 tag = file_data[file_index++];
+	if (decoder->column_index >= decoder->width) {
+		decoder->row_index    += decoder->column_index / decoder->width;
+		decoder->column_index %= decoder->width;
+	}
+}
+
+// Decodes chunks starting at data[*data_index] until count pixels have been
+// written or there is no complete chunk left in the data. Returns the number
+// of pixels that were written. Chunks are at most QOI_MAX_BYTES_PER_PIXEL
+// long, so a return value of 0 means that more data is needed.
+static gsize qoi_decoder_decode(QoiDecoder *decoder, const guint8 *data, gsize size, gsize *data_index, QoiPixel *pixels, gsize count) {
+	QoiPixel *array         = decoder->array;
+	gsize     file_index    = *data_index;
+	gsize     pixel_index   = MIN(decoder->run, count);
+
+	for (gsize i = 0; i < pixel_index; ++i) {
+		pixels[i] = decoder->current_pixel;
+	}
+	decoder->run -= pixel_index;
+
+	while (pixel_index < count && file_index + QOI_MAX_BYTES_PER_PIXEL <= size) {
+		QoiPixel current_pixel = decoder->current_pixel;
+		guint32  length        = 1;
+		bool     may_be_new    = true;
+
+		guint8 tag = data[file_index++];
 		if (tag == QOI_OP_RGB) {
-			current_pixel.red   = file_data[file_index++];
-			current_pixel.green = file_data[file_index++];
-			current_pixel.blue  = file_data[file_index++];
+			current_pixel.red   = data[file_index++];
+			current_pixel.green = data[file_index++];
+			current_pixel.blue  = data[file_index++];
 
-			result->pixels[pixel_index++] = current_pixel;
+			pixels[pixel_index++] = current_pixel;
 			array[qoi_pixel_hash(current_pixel)] = current_pixel;
-			++column_index;
 		} else if (tag == QOI_OP_RGBA) {
-			current_pixel.red   = file_data[file_index++];
-			current_pixel.green = file_data[file_index++];
-			current_pixel.blue  = file_data[file_index++];
-			current_pixel.alpha = file_data[file_index++];
+			current_pixel.red   = data[file_index++];
+			current_pixel.green = data[file_index++];
+			current_pixel.blue  = data[file_index++];
+			current_pixel.alpha = data[file_index++];
 
-			result->pixels[pixel_index++] = current_pixel;
+			pixels[pixel_index++] = current_pixel;
 			array[qoi_pixel_hash(current_pixel)] = current_pixel;
-			++column_index;
 		} else if ((tag & QOI_SMALL_TAG_MASK) == QOI_OP_INDEX) {
-			// There might be an end marker here as this chunk could be a 0
-			// byte which is the same byte the end marker starts with, so check
-			// just in case as the stream technically ends when the decoder
-			// reaches the end marker.
-			if (memcmp(&file_data[file_index - 1], QOI_END_MARKER, QOI_END_MARKER_SIZE) == 0) {
-				// Breaking here means the decoder does an extra check for the
-				// end marker, but that should be fast enough that it doesn't
-				// matter.
-				break;
-			}
-
 			guint8 index = tag & 0x3F;
 			current_pixel = array[index];
-			result->pixels[pixel_index++] = current_pixel;
-			++column_index;
+			pixels[pixel_index++] = current_pixel;
+			may_be_new = qoi_pixel_equal(current_pixel, (QoiPixel) { 0 });
 		} else if ((tag & QOI_SMALL_TAG_MASK) == QOI_OP_DIFF) {
 			gint dr = ((tag >> 4) & 0x03) + QOI_DIFF_LOWER_BOUND;
 			gint dg = ((tag >> 2) & 0x03) + QOI_DIFF_LOWER_BOUND;
@@ -257,11 +793,10 @@ fail_without_file:
 			current_pixel.green += dg;
 			current_pixel.blue  += db;
 
-			result->pixels[pixel_index++] = current_pixel;
+			pixels[pixel_index++] = current_pixel;
 			array[qoi_pixel_hash(current_pixel)] = current_pixel;
-			++column_index;
 		} else if ((tag & QOI_SMALL_TAG_MASK) == QOI_OP_LUMA) {
-			guint8 dr_db = file_data[file_index++];
+			guint8 dr_db = data[file_index++];
 
 			gint dg = (tag & 0x3F)          + QOI_LUMA_GREEN_LOWER_BOUND;
 			gint dr = ((dr_db >> 4) & 0x0F) + QOI_LUMA_RED_BLUE_LOWER_BOUND + dg;
@@ -271,394 +806,3785 @@ fail_without_file:
 			current_pixel.green += dg;
 			current_pixel.blue  += db;
 
-			result->pixels[pixel_index++] = current_pixel;
+			pixels[pixel_index++] = current_pixel;
 			array[qoi_pixel_hash(current_pixel)] = current_pixel;
-			++column_index;
 		} else if ((tag & QOI_SMALL_TAG_MASK) == QOI_OP_RUN) {
-			guint8 run = (tag & 0x3F) + 1;
-
-			// Make sure there is enough space for all of the encoded pixels
-			if (pixel_index + run > pixel_count) {
-				g_message("Too many encoded pixels.");
-				g_free(result->pixels);
-				g_free(file_data);
-				return false;
-			}
+			length = (tag & 0x3F) + 1;
 
-			while (run-- != 0) {
-				result->pixels[pixel_index++] = current_pixel;
-				++column_index;
+			guint32 written = MIN(length, count - pixel_index);
+			for (guint32 i = 0; i < written; ++i) {
+				pixels[pixel_index++] = current_pixel;
 			}
+			decoder->run = length - written;
 			array[qoi_pixel_hash(current_pixel)] = current_pixel;
+			may_be_new = qoi_pixel_equal(current_pixel, (QoiPixel) { .alpha = 255 });
 		}
 
-		if (column_index >= result->width) {
-			column_index -= result->width;
-			gimp_progress_update((gdouble) pixel_index / (gdouble) pixel_count);
-		}
+		decoder->current_pixel = current_pixel;
+		qoi_decoder_track_chunk(decoder, length, may_be_new);
 	}
 
-	if (file_size < file_index + QOI_END_MARKER_SIZE) {
-		g_message("The file ends unexpectedly.");
-		g_free(result->pixels);
-		g_free(file_data);
-		return false;
-	}
+	*data_index = file_index;
+	return pixel_index;
+}
 
-	if (memcmp(&file_data[file_index], QOI_END_MARKER, QOI_END_MARKER_SIZE) != 0) {
-		g_message("Invalid end marker.");
-		g_free(result->pixels);
-		g_free(file_data);
-		return false;
-	}
-	file_index += QOI_END_MARKER_SIZE;
+#define QOI_READ_BUFFER_SIZE (64 * 1024)
 
-	if (file_index != file_size) {
-		g_message("File contains data past the end marker.");
-		g_free(result->pixels);
-		g_free(file_data);
-		return false;
-	}
+#define ZIP_LOCAL_HEADER_SIGNATURE   0x04034B50
+#define ZIP_CENTRAL_HEADER_SIGNATURE 0x02014B50
+#define ZIP_END_SIGNATURE            0x06054B50
+#define ZIP_LOCAL_HEADER_SIZE        30
+#define ZIP_CENTRAL_HEADER_SIZE      46
+#define ZIP_END_SIZE                 22
+#define ZIP_MAX_COMMENT_SIZE         0xFFFF
+#define ZIP_METHOD_STORED            0
+#define ZIP_METHOD_DEFLATED          8
+#define ZIP_FLAG_ENCRYPTED           0x0001
 
-	g_free(file_data);
+#define TAR_BLOCK_SIZE 512
 
-	gimp_progress_end();
+// File data for the decoder. Everything from position to size in data is
+// ready to be decoded. Files and members that are stored as they are in an
+// archive are mapped and used without copying, compressed members are
+// inflated into a buffer a piece at a time.
+typedef struct {
+	const guint8 *data;
+	gsize         size;
+	gsize         position;
 
-	return true;
+	GMappedFile  *mapping;
+	guint8       *buffer;
+	z_stream      stream;
+	bool          is_compressed;
+} QoiReader;
+
+static inline guint16 guint16_read_little_endian(const guint8 *data) {
+	return data[0] | (data[1] << 8);
 }
 
-// The only reason the GIMP API is used in this function is to indicate
-// progress to the user. Updating the progress for every pixel would slow down
-// saving a lot, so it is only updated when we have encoded one row of pixels.
-static bool save_image(QoiImage image, const gchar *filename) {
-	gimp_progress_init_printf("Exporting '%s'", filename);
+static inline guint32 guint32_read_little_endian(const guint8 *data) {
+	return data[0] | (data[1] << 8) | (data[2] << 16) | ((guint32) data[3] << 24);
+}
 
-	guint8 *file_data = g_try_malloc(
-		QOI_HEADER_SIZE +
-		image.width * image.height * QOI_MAX_BYTES_PER_PIXEL +
-		QOI_END_MARKER_SIZE
-	);
-	if (!file_data) {
+// Looks up the member in the central directory and points the reader at its
+// data. Only the central directory and the local header of the member are
+// read, no matter how many other members there are.
+static bool qoi_reader_open_zip_member(QoiReader *reader, const guint8 *archive, gsize archive_size, const gchar *member) {
+	if (archive_size < ZIP_END_SIZE) {
+		g_message("The archive ends unexpectedly.");
 		return false;
 	}
-	gint32 file_index = 0;
-
-	QoiHeader header;
-	header.magic[0]   = 'q';
-	header.magic[1]   = 'o';
-	header.magic[2]   = 'i';
-	header.magic[3]   = 'f';
-	header.width      = guint32_swap_local_and_big_endian(image.width);
-	header.height     = guint32_swap_local_and_big_endian(image.height);
-	header.channels   = image.has_alpha ? QOI_CHANNELS_RGBA : QOI_CHANNELS_RGB;
-	header.colorspace = image.colorspace;
-
-	*(QoiHeader *) &file_data[file_index] = header;
-	file_index += QOI_HEADER_SIZE;
-
-	guint32 column_index    = 0;
-	guint64 pixel_count     = image.width * image.height;
-	QoiPixel previous_pixel = { .alpha = 255 };
-	QoiPixel array[64]      = { 0 };
-	for (guint32 pixel_index = 0; pixel_index < pixel_count;) {
-		QoiPixel current_pixel = image.pixels[pixel_index];
-		guint32  hash          = qoi_pixel_hash(current_pixel);
-
-		if (qoi_pixel_equal(previous_pixel, current_pixel)) {
-			guint8 run = 0;
-			bool process_next = true;
-			while (process_next) {
-				++run;
-				++pixel_index;
-				++column_index;
-
-				process_next = (
-					pixel_index < pixel_count &&
-					qoi_pixel_equal(previous_pixel, image.pixels[pixel_index])
-				);
-				if (run == QOI_MAX_RUN_LENGTH || !process_next) {
-					file_data[file_index++] = QOI_OP_RUN | (run - 1);
-					run = 0;
-				}
-			}
-			array[hash] = current_pixel;
-		} else if (qoi_pixel_equal(current_pixel, array[hash])) {
-			file_data[file_index++] = QOI_OP_INDEX | hash;
-			previous_pixel = current_pixel;
-			++pixel_index;
-			++column_index;
-		} else if (!image.has_alpha || current_pixel.alpha == previous_pixel.alpha) {
-			gint32 dr = (gint32) (current_pixel.red   - previous_pixel.red);
-			gint32 dg = (gint32) (current_pixel.green - previous_pixel.green);
-			gint32 db = (gint32) (current_pixel.blue  - previous_pixel.blue);
-			gint32 dr_dg = dr - dg;
-			gint32 db_dg = db - dg;
-
-			if (
-				QOI_DIFF_LOWER_BOUND <= dr && dr <= QOI_DIFF_UPPER_BOUND &&
-				QOI_DIFF_LOWER_BOUND <= dg && dg <= QOI_DIFF_UPPER_BOUND &&
-				QOI_DIFF_LOWER_BOUND <= db && db <= QOI_DIFF_UPPER_BOUND
-			) {
-				file_data[file_index++] =
-					QOI_OP_DIFF |
-					((dr - QOI_DIFF_LOWER_BOUND) << 4) |
-					((dg - QOI_DIFF_LOWER_BOUND) << 2) |
-					((db - QOI_DIFF_LOWER_BOUND) << 0);
-			} else if (
-				QOI_LUMA_GREEN_LOWER_BOUND <= dg && dg <= QOI_LUMA_GREEN_UPPER_BOUND &&
-				QOI_LUMA_RED_BLUE_LOWER_BOUND <= dr_dg && dr_dg <= QOI_LUMA_RED_BLUE_UPPER_BOUND &&
-				QOI_LUMA_RED_BLUE_LOWER_BOUND <= db_dg && db_dg <= QOI_LUMA_RED_BLUE_UPPER_BOUND
-			) {
-				file_data[file_index++] = QOI_OP_LUMA | (dg - QOI_LUMA_GREEN_LOWER_BOUND);
-				file_data[file_index++] =
-					((dr_dg - QOI_LUMA_RED_BLUE_LOWER_BOUND) << 4) |
-					((db_dg - QOI_LUMA_RED_BLUE_LOWER_BOUND) << 0);
-			} else {
-				file_data[file_index++] = QOI_OP_RGB;
-				file_data[file_index++] = current_pixel.red;
-				file_data[file_index++] = current_pixel.green;
-				file_data[file_index++] = current_pixel.blue;
-			}
 
-			array[hash] = current_pixel;
-			previous_pixel = current_pixel;
-			++pixel_index;
-			++column_index;
-		} else {
-			file_data[file_index++] = QOI_OP_RGBA;
-			file_data[file_index++] = current_pixel.red;
-			file_data[file_index++] = current_pixel.green;
-			file_data[file_index++] = current_pixel.blue;
-			file_data[file_index++] = current_pixel.alpha;
-			array[hash] = current_pixel;
-			previous_pixel = current_pixel;
-			++pixel_index;
-			++column_index;
-		}
-
-		if (column_index >= image.width) {
-			column_index -= image.width;
-			gimp_progress_update((gdouble) pixel_index / (gdouble) pixel_count);
+	// The end of central directory record is followed by a comment of
+	// unknown size, so search backwards for its signature.
+	gsize end_index   = archive_size - ZIP_END_SIZE;
+	gsize search_stop = archive_size > ZIP_END_SIZE + ZIP_MAX_COMMENT_SIZE ? archive_size - ZIP_END_SIZE - ZIP_MAX_COMMENT_SIZE : 0;
+	while (guint32_read_little_endian(&archive[end_index]) != ZIP_END_SIGNATURE) {
+		if (end_index == search_stop) {
+			g_message("Could not find the central directory of the archive.");
+			return false;
 		}
+		--end_index;
 	}
 
-	memcpy(&file_data[file_index], QOI_END_MARKER, QOI_END_MARKER_SIZE);
-	file_index += QOI_END_MARKER_SIZE;
-
-	FILE *fd = fopen(filename, "wb");
-	if (!fd) {
-		g_free(file_data);
+	guint16 entry_count      = guint16_read_little_endian(&archive[end_index + 10]);
+	guint32 directory_size   = guint32_read_little_endian(&archive[end_index + 12]);
+	guint32 directory_offset = guint32_read_little_endian(&archive[end_index + 16]);
+	if (directory_offset == G_MAXUINT32 || (gsize) directory_offset + directory_size > end_index) {
+		g_message("Unsupported or invalid central directory in the archive.");
 		return false;
 	}
 
-	if (fwrite(file_data, 1, file_index, fd) != file_index) {
-		fclose(fd);
-		g_free(file_data);
-		return false;
-	}
+	gsize member_length = strlen(member);
+	gsize entry_index   = directory_offset;
+	for (guint16 entry = 0; entry < entry_count; ++entry) {
+		if (
+			entry_index + ZIP_CENTRAL_HEADER_SIZE > end_index ||
+			guint32_read_little_endian(&archive[entry_index]) != ZIP_CENTRAL_HEADER_SIGNATURE
+		) {
+			g_message("Invalid central directory in the archive.");
+			return false;
+		}
 
-	fclose(fd);
+		guint16 flags           = guint16_read_little_endian(&archive[entry_index + 8]);
+		guint16 method          = guint16_read_little_endian(&archive[entry_index + 10]);
+		guint32 compressed_size = guint32_read_little_endian(&archive[entry_index + 20]);
+		guint16 name_length     = guint16_read_little_endian(&archive[entry_index + 28]);
+		guint16 extra_length    = guint16_read_little_endian(&archive[entry_index + 30]);
+		guint16 comment_length  = guint16_read_little_endian(&archive[entry_index + 32]);
+		guint32 header_offset   = guint32_read_little_endian(&archive[entry_index + 42]);
+		const guint8 *name      = &archive[entry_index + ZIP_CENTRAL_HEADER_SIZE];
 
-	g_free(file_data);
+		entry_index += ZIP_CENTRAL_HEADER_SIZE + name_length + extra_length + comment_length;
+		if (entry_index > end_index) {
+			g_message("Invalid central directory in the archive.");
+			return false;
+		}
+
+		if (name_length != member_length || memcmp(name, member, member_length) != 0) {
+			continue;
+		}
+
+		if (flags & ZIP_FLAG_ENCRYPTED) {
+			g_message("'%s' is encrypted, which is not supported.", member);
+			return false;
+		}
+
+		if (
+			(gsize) header_offset + ZIP_LOCAL_HEADER_SIZE > archive_size ||
+			guint32_read_little_endian(&archive[header_offset]) != ZIP_LOCAL_HEADER_SIGNATURE
+		) {
+			g_message("Invalid local header for '%s' in the archive.", member);
+			return false;
+		}
+
+		gsize data_offset = (gsize) header_offset + ZIP_LOCAL_HEADER_SIZE +
+			guint16_read_little_endian(&archive[header_offset + 26]) +
+			guint16_read_little_endian(&archive[header_offset + 28]);
+		if (data_offset + compressed_size > archive_size) {
+			g_message("The archive ends unexpectedly.");
+			return false;
+		}
+
+		switch (method) {
+			case ZIP_METHOD_STORED: {
+				reader->data = &archive[data_offset];
+				reader->size = compressed_size;
+			} break;
+			case ZIP_METHOD_DEFLATED: {
+				reader->buffer = g_try_malloc(QOI_READ_BUFFER_SIZE);
+				if (!reader->buffer) {
+					g_message("Failed to acquire storage for the archive member.");
+					return false;
+				}
+
+				reader->stream.next_in  = (Bytef *) &archive[data_offset];
+				reader->stream.avail_in = compressed_size;
+				if (inflateInit2(&reader->stream, -MAX_WBITS) != Z_OK) {
+					g_message("Could not start decompressing '%s'.", member);
+					return false;
+				}
+				reader->is_compressed = true;
+				reader->data          = reader->buffer;
+				reader->size          = 0;
+			} break;
+			default: {
+				g_message("Unsupported compression method for '%s': %u.", member, method);
+				return false;
+			} break;
+		}
+
+		return true;
+	}
+
+	g_message("Could not find '%s' in the archive.", member);
+	return false;
+}
+
+static guint64 tar_parse_octal(const guint8 *field, gsize size) {
+	guint64 value = 0;
+	for (gsize i = 0; i < size && field[i] >= '0' && field[i] <= '7'; ++i) {
+		value = value * 8 + (field[i] - '0');
+	}
+	return value;
+}
+
+// Tar archives don't have a directory, so the headers are walked until the
+// member is found. Members are never compressed, so the data is used in
+// place.
+static bool qoi_reader_open_tar_member(QoiReader *reader, const guint8 *archive, gsize archive_size, const gchar *member) {
+	gchar  name[2 * TAR_BLOCK_SIZE];
+	gchar *long_name = 0;
+
+	gsize header_index = 0;
+	while (header_index + TAR_BLOCK_SIZE <= archive_size && archive[header_index] != 0) {
+		const guint8 *header = &archive[header_index];
+		guint64 size = tar_parse_octal(&header[124], 12);
+		gchar   type = header[156];
+
+		gsize data_index = header_index + TAR_BLOCK_SIZE;
+		if (size > archive_size - data_index) {
+			break;
+		}
+		header_index = data_index + (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+
+		// GNU tar stores long names in a separate entry before the member.
+		if (type == 'L') {
+			g_free(long_name);
+			long_name = g_strndup((const gchar *) &archive[data_index], size);
+			continue;
+		}
+
+		if (long_name) {
+			g_strlcpy(name, long_name, sizeof(name));
+			g_free(long_name);
+			long_name = 0;
+		} else if (memcmp(&header[257], "ustar", 5) == 0 && header[345] != 0) {
+			g_snprintf(name, sizeof(name), "%.155s/%.100s", &header[345], header);
+		} else {
+			g_snprintf(name, sizeof(name), "%.100s", header);
+		}
+
+		if ((type == '0' || type == 0) && strcmp(name, member) == 0) {
+			reader->data = &archive[data_index];
+			reader->size = size;
+			return true;
+		}
+	}
+	g_free(long_name);
+
+	g_message("Could not find '%s' in the archive.", member);
+	return false;
+}
+
+static void qoi_reader_close(QoiReader *reader) {
+	if (reader->is_compressed) {
+		inflateEnd(&reader->stream);
+	}
+	g_free(reader->buffer);
+	if (reader->mapping) {
+		g_mapped_file_unref(reader->mapping);
+	}
+}
+
+// A location is either the name of a QOI file or the name of a zip or tar
+// archive and the path of a member inside of it, separated by '#'. File names
+// can contain '#' as well, so the location is only split when there isn't a
+// file with that name. Returns the name of the file to read, member is set to
+// the path inside of the archive or to 0 for plain files.
+static gchar *split_location(const gchar *location, const gchar **member) {
+	*member = 0;
+	if (!g_file_test(location, G_FILE_TEST_EXISTS)) {
+		for (const gchar *separator = strchr(location, '#'); separator; separator = strchr(separator + 1, '#')) {
+			gchar *archive_name = g_strndup(location, separator - location);
+			if (g_file_test(archive_name, G_FILE_TEST_IS_REGULAR)) {
+				*member = separator + 1;
+				return archive_name;
+			}
+			g_free(archive_name);
+		}
+	}
+	return g_strdup(location);
+}
+
+static bool qoi_reader_open(QoiReader *reader, const gchar *location) {
+	*reader = (QoiReader) { 0 };
+
+	const gchar *member    = 0;
+	gchar       *file_name = split_location(location, &member);
+
+	GError *error = 0;
+	reader->mapping = g_mapped_file_new(file_name, false, &error);
+	g_free(file_name);
+	if (!reader->mapping) {
+		g_message("Could not read from file. %s", error->message);
+		g_error_free(error);
+		return false;
+	}
+
+	const guint8 *file_data = (const guint8 *) g_mapped_file_get_contents(reader->mapping);
+	gsize         file_size = g_mapped_file_get_length(reader->mapping);
+
+	bool success = true;
+	if (!member) {
+		reader->data = file_data;
+		reader->size = file_size;
+	} else if (file_size >= 4 && guint32_read_little_endian(file_data) == ZIP_LOCAL_HEADER_SIGNATURE) {
+		success = qoi_reader_open_zip_member(reader, file_data, file_size, member);
+	} else if (file_size >= TAR_BLOCK_SIZE && memcmp(&file_data[257], "ustar", 5) == 0) {
+		success = qoi_reader_open_tar_member(reader, file_data, file_size, member);
+	} else {
+		g_message("'%.*s' is not a zip or tar archive.", (gint) (member - location - 1), location);
+		success = false;
+	}
+
+	if (!success) {
+		qoi_reader_close(reader);
+	}
+	return success;
+}
+
+// Makes more data available after the data that hasn't been read yet.
+// Returns false when there is no more data.
+static bool qoi_reader_refill(QoiReader *reader) {
+	if (!reader->is_compressed) {
+		return false;
+	}
+
+	QoiPhase previous = qoi_trace_enter(QOI_PHASE_IO);
+
+	gsize remaining = reader->size - reader->position;
+	memmove(reader->buffer, &reader->data[reader->position], remaining);
+	reader->position = 0;
+
+	reader->stream.next_out  = &reader->buffer[remaining];
+	reader->stream.avail_out = QOI_READ_BUFFER_SIZE - remaining;
+	int status = inflate(&reader->stream, Z_NO_FLUSH);
+	reader->size = QOI_READ_BUFFER_SIZE - reader->stream.avail_out;
+
+	qoi_trace_enter(previous);
+
+	if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+		g_message("The archive member is corrupt.");
+		return false;
+	}
+
+	return reader->size > remaining;
+}
+
+// Makes sure that at least size bytes can be read.
+static bool qoi_reader_require(QoiReader *reader, gsize size) {
+	while (reader->size - reader->position < size) {
+		if (!qoi_reader_refill(reader)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// The only reason the GIMP API is used in this function is to indicate
+// progress to the user. Updating the progress for every pixel would slow down
+// loading a lot, so it is only updated when we have decoded one row of pixels.
+static bool load_image(const gchar *filename, QoiImage *result, QoiDecodeStats *stats) {
+	gimp_progress_init_printf("Opening '%s'", filename);
+
+	QoiReader reader;
+	QoiPhase  previous  = qoi_trace_enter(QOI_PHASE_IO);
+	bool      is_opened = qoi_reader_open(&reader, filename);
+	qoi_trace_enter(previous);
+	if (!is_opened) {
+		return false;
+	}
+
+	if (!qoi_reader_require(&reader, QOI_HEADER_SIZE)) {
+		g_message("The file ends unexpectedly.");
+		qoi_reader_close(&reader);
+		return false;
+	}
+
+	QoiHeader header;
+	memcpy(&header, &reader.data[reader.position], QOI_HEADER_SIZE);
+	reader.position += QOI_HEADER_SIZE;
+
+	if (memcmp(header.magic, "qoif", 4) != 0) {
+		g_message("'%s' is not a valid QOI file.", filename);
+		qoi_reader_close(&reader);
+		return false;
+	}
+
+	switch (header.channels) {
+		case QOI_CHANNELS_RGB: result->has_alpha = false; break;
+		case QOI_CHANNELS_RGBA: result->has_alpha = true; break;
+		default: {
+			g_message("Unsupported or unknown number of channels: %u.", header.channels);
+			qoi_reader_close(&reader);
+			return false;
+		} break;
+	}
+
+	switch (header.colorspace) {
+		case QOI_COLORSPACE_SRGB: break;
+		case QOI_COLORSPACE_LINEAR: break;
+		default: {
+			g_message("Unsupported or unknown colorspace: %u.", header.colorspace);
+			qoi_reader_close(&reader);
+			return false;
+		} break;
+	}
+	result->colorspace = header.colorspace;
+
+	result->width = guint32_swap_local_and_big_endian(header.width);
+	result->height = guint32_swap_local_and_big_endian(header.height);
+
+	if (result->width == 0 || result->width > GIMP_MAX_IMAGE_SIZE) {
+		g_message("Invalid or unsupported width: %u.", result->width);
+		qoi_reader_close(&reader);
+		return false;
+	}
+
+	if (result->height == 0 || result->height > GIMP_MAX_IMAGE_SIZE) {
+		g_message("Invalid or unsupported height: %u.", result->height);
+		qoi_reader_close(&reader);
+		return false;
+	}
+
+	result->content_x      = 0;
+	result->content_y      = 0;
+	result->content_width  = result->width;
+	result->content_height = result->height;
+
+	result->pixels = g_try_malloc((gsize) result->width * result->height * sizeof(*result->pixels));
+	if (!result->pixels) {
+		g_message("Failed to acquire storage for pixels.");
+		qoi_reader_close(&reader);
+		return false;
+	}
+
+	QoiDecoder decoder;
+	qoi_decoder_begin(&decoder, result->width, result->has_alpha, stats);
+
+	for (guint32 y = 0; y < result->height; ++y) {
+		QoiPixel *row     = &result->pixels[(gsize) y * result->width];
+		gsize     written = 0;
+		while (written < result->width) {
+			gsize decoded = qoi_decoder_decode(
+				&decoder,
+				reader.data, reader.size, &reader.position,
+				&row[written], result->width - written
+			);
+			written += decoded;
+
+			if (decoded == 0 && !qoi_reader_refill(&reader)) {
+				g_message("The file ends unexpectedly.");
+				g_free(result->pixels);
+				result->pixels = 0;
+				qoi_reader_close(&reader);
+				return false;
+			}
+		}
+
+		qoi_progress_update((gdouble) y / (gdouble) result->height);
+	}
+
+	if (decoder.run != 0) {
+		g_message("Too many encoded pixels.");
+		g_free(result->pixels);
+		result->pixels = 0;
+		qoi_reader_close(&reader);
+		return false;
+	}
+
+	if (!qoi_reader_require(&reader, QOI_END_MARKER_SIZE)) {
+		g_message("The file ends unexpectedly.");
+		g_free(result->pixels);
+		result->pixels = 0;
+		qoi_reader_close(&reader);
+		return false;
+	}
+
+	if (memcmp(&reader.data[reader.position], QOI_END_MARKER, QOI_END_MARKER_SIZE) != 0) {
+		g_message("Invalid end marker.");
+		g_free(result->pixels);
+		result->pixels = 0;
+		qoi_reader_close(&reader);
+		return false;
+	}
+	reader.position += QOI_END_MARKER_SIZE;
+
+	if (reader.position != reader.size || qoi_reader_refill(&reader)) {
+		g_message("File contains data past the end marker.");
+		g_free(result->pixels);
+		result->pixels = 0;
+		qoi_reader_close(&reader);
+		return false;
+	}
+
+	qoi_reader_close(&reader);
 
 	gimp_progress_end();
 
 	return true;
 }
 
-#define DATE "2022"
-#define LOAD_PROC "file-qoi-load"
-#define SAVE_PROC "file-qoi-save"
+#define QOI_CACHE_MAGIC "QOICACHE"
+#define QOI_CACHE_VERSION 1
+#define QOI_CACHE_SUFFIX ".cache"
+#define QOI_CACHE_ALIGNMENT 16
+#define QOI_CACHE_TEMPORARY_MAX_AGE 60
 
+// Entries in the cache start with this header, followed by the location the
+// pixels were loaded from and then the pixels themselves. The location and
+// the file information have to match for an entry to be used, so an entry is
+// never used for a file that has changed since.
 typedef struct {
-	QoiColorspace colorspace;
-	bool          export_alpha;
-} QoiExportOptions;
+	gchar          magic[8];
+	guint32        version;
+	guint32        location_length;
+	guint64        file_size;
+	gint64         modified_seconds;
+	gint64         modified_nanoseconds;
+	guint64        inode;
+	guint64        device;
+	guint32        width;
+	guint32        height;
+	guint32        colorspace;
+	guint32        has_alpha;
+	QoiDecodeStats stats;
+} QoiCacheHeader;
 
-static GimpExportReturn show_export_dialog(gint32 *image, gint32 *drawable, QoiExportOptions *options) {
-	GimpExportReturn export = GIMP_EXPORT_IGNORE;
+// Creates the directory if needed. Other users can create directories in
+// /dev/shm too, so one that already exists is only used when it is a real
+// directory that belongs to this user and nobody else can write to.
+static bool qoi_cache_directory_is_private(const gchar *directory) {
+	if (g_mkdir_with_parents(directory, 0700) != 0) {
+		return false;
+	}
+
+	struct stat directory_stat;
+	return (
+		lstat(directory, &directory_stat) == 0 &&
+		S_ISDIR(directory_stat.st_mode) &&
+		directory_stat.st_uid == getuid() &&
+		(directory_stat.st_mode & 0777) == 0700
+	);
+}
+
+// The cache lives in shared memory when there is a tmpfs for it, so that
+// entries are kept in memory for other runs of the plug-in.
+static gchar *qoi_cache_directory(void) {
+	if (g_file_test("/dev/shm", G_FILE_TEST_IS_DIR)) {
+		gchar *directory = g_strdup_printf("/dev/shm/gimp-file-qoi-%u", (guint) getuid());
+		if (qoi_cache_directory_is_private(directory)) {
+			return directory;
+		}
+		g_free(directory);
+	}
+
+	gchar *directory = g_build_filename(g_get_user_cache_dir(), "gimp-file-qoi", NULL);
+	if (qoi_cache_directory_is_private(directory)) {
+		return directory;
+	}
+	g_free(directory);
+	return 0;
+}
+
+static gchar *qoi_cache_entry_name(const gchar *directory, const gchar *location) {
+	gchar *hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, location, -1);
+	gchar *name = g_strdup_printf("%s%s%s%s", directory, G_DIR_SEPARATOR_S, hash, QOI_CACHE_SUFFIX);
+	g_free(hash);
+	return name;
+}
+
+static gsize qoi_cache_pixels_offset(const QoiCacheHeader *header) {
+	gsize offset = sizeof(*header) + header->location_length;
+	return (offset + QOI_CACHE_ALIGNMENT - 1) / QOI_CACHE_ALIGNMENT * QOI_CACHE_ALIGNMENT;
+}
+
+// Fills in everything in the header that identifies the file at the location.
+static bool qoi_cache_fill_key(const gchar *location, QoiCacheHeader *header) {
+	const gchar *member    = 0;
+	gchar       *file_name = split_location(location, &member);
+
+	struct stat file_stat;
+	bool found = stat(file_name, &file_stat) == 0;
+	g_free(file_name);
+	if (!found) {
+		return false;
+	}
+
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, QOI_CACHE_MAGIC, sizeof(header->magic));
+	header->version              = QOI_CACHE_VERSION;
+	header->location_length      = strlen(location);
+	header->file_size            = file_stat.st_size;
+	header->modified_seconds     = file_stat.st_mtim.tv_sec;
+	header->modified_nanoseconds = file_stat.st_mtim.tv_nsec;
+	header->inode                = file_stat.st_ino;
+	header->device               = file_stat.st_dev;
+	return true;
+}
+
+// On a hit, the pixels of the result point into the returned mapping, which
+// has to be kept until the pixels are no longer used.
+static GMappedFile *qoi_cache_lookup(const gchar *location, QoiImage *result, QoiDecodeStats *stats) {
+	QoiCacheHeader key;
+	if (!qoi_cache_fill_key(location, &key)) {
+		return 0;
+	}
+
+	gchar *directory = qoi_cache_directory();
+	if (!directory) {
+		return 0;
+	}
+	gchar *entry_name = qoi_cache_entry_name(directory, location);
+	g_free(directory);
+
+	GMappedFile *mapping = g_mapped_file_new(entry_name, false, 0);
+	if (!mapping) {
+		g_free(entry_name);
+		return 0;
+	}
+
+	const guint8 *data = (const guint8 *) g_mapped_file_get_contents(mapping);
+	gsize         size = g_mapped_file_get_length(mapping);
+
+	QoiCacheHeader header;
+	bool is_hit = size >= sizeof(header);
+	if (is_hit) {
+		memcpy(&header, data, sizeof(header));
+		gsize pixels_offset = qoi_cache_pixels_offset(&header);
+		is_hit = (
+			memcmp(header.magic, key.magic, sizeof(key.magic)) == 0 &&
+			header.version              == key.version &&
+			header.location_length      == key.location_length &&
+			header.file_size            == key.file_size &&
+			header.modified_seconds     == key.modified_seconds &&
+			header.modified_nanoseconds == key.modified_nanoseconds &&
+			header.inode                == key.inode &&
+			header.device               == key.device &&
+			header.colorspace           <  QOI_COLORSPACE_COUNT &&
+			qoi_decode_stats_is_valid(&header.stats, header.width, header.height) &&
+			size == pixels_offset + (gsize) header.width * header.height * sizeof(QoiPixel) &&
+			memcmp(&data[sizeof(header)], location, key.location_length) == 0
+		);
+
+		if (is_hit) {
+			result->pixels         = (QoiPixel *) &data[pixels_offset];
+			result->width          = header.width;
+			result->height         = header.height;
+			result->content_x      = 0;
+			result->content_y      = 0;
+			result->content_width  = header.width;
+			result->content_height = header.height;
+			result->colorspace     = header.colorspace;
+			result->has_alpha      = header.has_alpha;
+			*stats                 = header.stats;
+
+			// The modification time of entries is what decides which ones are
+			// removed first.
+			utime(entry_name, 0);
+		}
+	}
+	g_free(entry_name);
+
+	if (!is_hit) {
+		g_mapped_file_unref(mapping);
+		return 0;
+	}
+	return mapping;
+}
+
+typedef struct {
+	gchar  *name;
+	guint64 size;
+	gint64  modified;
+} QoiCacheEntry;
+
+static gint qoi_cache_entry_compare(gconstpointer a, gconstpointer b) {
+	const QoiCacheEntry *entry_a = *(QoiCacheEntry * const *) a;
+	const QoiCacheEntry *entry_b = *(QoiCacheEntry * const *) b;
+	return (entry_a->modified > entry_b->modified) - (entry_a->modified < entry_b->modified);
+}
+
+static void qoi_cache_entry_free(gpointer data) {
+	QoiCacheEntry *entry = data;
+	g_free(entry->name);
+	g_free(entry);
+}
+
+// Removes the least recently used entries until the cache fits in limit.
+// Temporary files that are older than QOI_CACHE_TEMPORARY_MAX_AGE seconds
+// were left behind by runs that crashed or failed to rename them, and are
+// removed as well.
+static void qoi_cache_trim(const gchar *directory, guint64 limit) {
+	GDir *dir = g_dir_open(directory, 0, 0);
+	if (!dir) {
+		return;
+	}
+
+	GPtrArray *entries = g_ptr_array_new_with_free_func(qoi_cache_entry_free);
+	guint64    total   = 0;
+	gint64     now     = g_get_real_time() / G_USEC_PER_SEC;
+	for (const gchar *name = g_dir_read_name(dir); name; name = g_dir_read_name(dir)) {
+		bool is_entry     = g_str_has_suffix(name, QOI_CACHE_SUFFIX);
+		bool is_temporary = strstr(name, QOI_CACHE_SUFFIX ".") != 0;
+		if (!is_entry && !is_temporary) {
+			continue;
+		}
+
+		gchar *path = g_build_filename(directory, name, NULL);
+		struct stat entry_stat;
+		if (lstat(path, &entry_stat) != 0 || !S_ISREG(entry_stat.st_mode)) {
+			g_free(path);
+			continue;
+		}
+
+		if (is_temporary) {
+			if (now - entry_stat.st_mtime > QOI_CACHE_TEMPORARY_MAX_AGE) {
+				g_unlink(path);
+			}
+			g_free(path);
+			continue;
+		}
+
+		QoiCacheEntry *entry = g_new(QoiCacheEntry, 1);
+		entry->name     = path;
+		entry->size     = entry_stat.st_size;
+		entry->modified = entry_stat.st_mtime;
+		g_ptr_array_add(entries, entry);
+		total += entry->size;
+	}
+	g_dir_close(dir);
+
+	g_ptr_array_sort(entries, qoi_cache_entry_compare);
+	for (guint i = 0; i < entries->len && total > limit; ++i) {
+		QoiCacheEntry *entry = entries->pdata[i];
+		if (g_unlink(entry->name) == 0) {
+			total -= entry->size;
+		}
+	}
+
+	g_ptr_array_free(entries, true);
+}
+
+// Entries are written to a temporary file first and then renamed, so other
+// runs of the plug-in never see an entry that is only partially written.
+static void qoi_cache_store(const gchar *location, QoiImage image, const QoiDecodeStats *stats, guint64 limit) {
+	QoiCacheHeader header;
+	if (!qoi_cache_fill_key(location, &header)) {
+		return;
+	}
+	header.width      = image.width;
+	header.height     = image.height;
+	header.colorspace = image.colorspace;
+	header.has_alpha  = image.has_alpha;
+	header.stats      = *stats;
+
+	gsize pixels_offset = qoi_cache_pixels_offset(&header);
+	gsize pixels_size   = (gsize) image.width * image.height * sizeof(QoiPixel);
+	if (pixels_offset + pixels_size > limit) {
+		return;
+	}
+
+	gchar *directory = qoi_cache_directory();
+	if (!directory) {
+		return;
+	}
+	gchar *entry_name     = qoi_cache_entry_name(directory, location);
+	gchar *temporary_name = g_strdup_printf("%s.XXXXXX", entry_name);
+
+	gint fd = g_mkstemp(temporary_name);
+	if (fd != -1) {
+		static const guint8 padding[QOI_CACHE_ALIGNMENT] = { 0 };
+		gsize padding_size = pixels_offset - sizeof(header) - header.location_length;
+
+		FILE *file = fdopen(fd, "wb");
+		bool success = (
+			file &&
+			fwrite(&header, 1, sizeof(header), file) == sizeof(header) &&
+			fwrite(location, 1, header.location_length, file) == header.location_length &&
+			fwrite(padding, 1, padding_size, file) == padding_size &&
+			fwrite(image.pixels, 1, pixels_size, file) == pixels_size
+		);
+		if (file) {
+			success = fclose(file) == 0 && success;
+		} else {
+			close(fd);
+		}
+
+		if (!success || g_rename(temporary_name, entry_name) != 0) {
+			g_unlink(temporary_name);
+		}
+	}
+
+	qoi_cache_trim(directory, limit);
+
+	g_free(temporary_name);
+	g_free(entry_name);
+	g_free(directory);
+}
+
+#define QOI_WRITE_BUFFER_SIZE (64 * 1024)
+
+// Encoder state that persists between calls, so that pixels can be handed to
+// the encoder in pieces. Encoded chunks are collected in a buffer that is
+// written to the file whenever it fills up.
+typedef struct {
+	FILE        *file;
+	guint8       buffer[QOI_WRITE_BUFFER_SIZE];
+	gsize        buffer_index;
+	bool         failed;
+
+	// When set, a copy of everything that is written to the file is pushed
+	// to this queue for a QoiVerifier.
+	GAsyncQueue *verify_queue;
+
+	// When set, everything that is written from record_index on is also
+	// appended to record, so that it can be written again later.
+	GByteArray  *record;
+	gsize        record_index;
+
+	QoiPixel previous_pixel;
+	QoiPixel array[64];
+	guint32  run;
+	bool     has_alpha;
+} QoiEncoder;
+
+// Everything that decides which chunks the encoder writes for the next
+// pixels. Encoding the same pixels from the same state writes the same chunks
+// and ends in the same state.
+typedef struct {
+	QoiPixel previous_pixel;
+	QoiPixel array[64];
+	guint32  run;
+} QoiEncoderState;
+
+static void qoi_encoder_save_state(const QoiEncoder *encoder, QoiEncoderState *state) {
+	state->previous_pixel = encoder->previous_pixel;
+	state->run            = encoder->run;
+	memcpy(state->array, encoder->array, sizeof(state->array));
+}
+
+static bool qoi_encoder_has_state(const QoiEncoder *encoder, const QoiEncoderState *state) {
+	return (
+		encoder->run == state->run &&
+		qoi_pixel_equal(encoder->previous_pixel, state->previous_pixel) &&
+		memcmp(encoder->array, state->array, sizeof(state->array)) == 0
+	);
+}
+
+static void qoi_encoder_flush(QoiEncoder *encoder) {
+	if (encoder->record) {
+		g_byte_array_append(encoder->record, &encoder->buffer[encoder->record_index], encoder->buffer_index - encoder->record_index);
+		encoder->record_index = 0;
+	}
+
+	if (encoder->verify_queue && encoder->buffer_index != 0) {
+		g_async_queue_push(encoder->verify_queue, g_bytes_new(encoder->buffer, encoder->buffer_index));
+	}
+
+	QoiPhase previous = qoi_trace_enter(QOI_PHASE_IO);
+	if (!encoder->failed && fwrite(encoder->buffer, 1, encoder->buffer_index, encoder->file) != encoder->buffer_index) {
+		encoder->failed = true;
+	}
+	qoi_trace_enter(previous);
+
+	encoder->buffer_index = 0;
+}
+
+static inline void qoi_encoder_reserve(QoiEncoder *encoder, gsize size) {
+	if (encoder->buffer_index + size > QOI_WRITE_BUFFER_SIZE) {
+		qoi_encoder_flush(encoder);
+	}
+}
+
+// Writes chunks that were recorded earlier as they are.
+static void qoi_encoder_write(QoiEncoder *encoder, const guint8 *data, gsize size) {
+	while (size != 0) {
+		qoi_encoder_reserve(encoder, 1);
+		gsize length = MIN(size, QOI_WRITE_BUFFER_SIZE - encoder->buffer_index);
+		memcpy(&encoder->buffer[encoder->buffer_index], data, length);
+		encoder->buffer_index += length;
+		data += length;
+		size -= length;
+	}
+}
+
+static void qoi_encoder_record_begin(QoiEncoder *encoder, GByteArray *record) {
+	g_byte_array_set_size(record, 0);
+	encoder->record       = record;
+	encoder->record_index = encoder->buffer_index;
+}
+
+static void qoi_encoder_record_end(QoiEncoder *encoder) {
+	g_byte_array_append(encoder->record, &encoder->buffer[encoder->record_index], encoder->buffer_index - encoder->record_index);
+	encoder->record = 0;
+}
+
+// The pixel of the run is already in the array, it is stored when the pixels
+// of a batch are looked up, before any of them is encoded.
+static inline void qoi_encoder_flush_run(QoiEncoder *encoder) {
+	if (encoder->run != 0) {
+		qoi_encoder_reserve(encoder, 1);
+		encoder->buffer[encoder->buffer_index++] = QOI_OP_RUN | (encoder->run - 1);
+		encoder->run = 0;
+	}
+}
+
+// The canvas and content rectangle of the image as they are in the file,
+// after the image has been turned.
+static QoiImage qoi_image_oriented(QoiImage image) {
+	QoiImage oriented = image;
+	qoi_orient_rectangle(
+		image.orientation, image.width, image.height,
+		&oriented.content_x, &oriented.content_y, &oriented.content_width, &oriented.content_height
+	);
+	if (qoi_orientation_swaps_sides(image.orientation)) {
+		oriented.width  = image.height;
+		oriented.height = image.width;
+	}
+	return oriented;
+}
+
+static bool qoi_image_is_transformed(QoiImage image) {
+	return image.orientation != QOI_ORIENTATION_NONE || (image.premultiply && image.has_alpha);
+}
+
+// Fills row with row y of the content rectangle as it is in the file.
+static void qoi_image_content_row(QoiImage image, guint32 y, QoiPixel *row) {
+	qoi_orient_row(image.pixels, image.content_width, image.content_width, image.content_height, image.orientation, y, row);
+	if (image.premultiply && image.has_alpha) {
+		qoi_premultiply_row(row, qoi_orientation_swaps_sides(image.orientation) ? image.content_height : image.content_width);
+	}
+}
+
+// Fills row with row y of the image as it is in the file, including the
+// background around the content and the alpha the decoder will see.
+static void qoi_image_file_row(QoiImage image, guint32 y, QoiPixel *row) {
+	QoiImage file       = qoi_image_oriented(image);
+	QoiPixel background = { .alpha = image.has_alpha ? 0 : 255 };
+	for (guint32 x = 0; x < file.width; ++x) {
+		row[x] = background;
+	}
+
+	if (y < file.content_y || y - file.content_y >= file.content_height) {
+		return;
+	}
+
+	QoiPixel *content = &row[file.content_x];
+	qoi_image_content_row(image, y - file.content_y, content);
+	if (!image.has_alpha) {
+		for (guint32 x = 0; x < file.content_width; ++x) {
+			content[x].alpha = 255;
+		}
+	}
+}
+
+static QoiHeader qoi_header_from_image(QoiImage image) {
+	image = qoi_image_oriented(image);
+
+	QoiHeader header;
+	header.magic[0]   = 'q';
+	header.magic[1]   = 'o';
+	header.magic[2]   = 'i';
+	header.magic[3]   = 'f';
+	header.width      = guint32_swap_local_and_big_endian(image.width);
+	header.height     = guint32_swap_local_and_big_endian(image.height);
+	header.channels   = image.has_alpha ? QOI_CHANNELS_RGBA : QOI_CHANNELS_RGB;
+	header.colorspace = image.colorspace;
+	return header;
+}
+
+static void qoi_encoder_begin(QoiEncoder *encoder, FILE *file, QoiImage image, GAsyncQueue *verify_queue) {
+	encoder->file           = file;
+	encoder->buffer_index   = 0;
+	encoder->failed         = false;
+	encoder->verify_queue   = verify_queue;
+	encoder->record         = 0;
+	encoder->previous_pixel = (QoiPixel) { .alpha = 255 };
+	encoder->run            = 0;
+	encoder->has_alpha      = image.has_alpha;
+	memset(encoder->array, 0, sizeof(encoder->array));
+
+	QoiHeader header = qoi_header_from_image(image);
+	memcpy(&encoder->buffer[encoder->buffer_index], &header, QOI_HEADER_SIZE);
+	encoder->buffer_index += QOI_HEADER_SIZE;
+}
+
+#define QOI_ENCODER_BATCH_SIZE 256
+
+// Finds the pixels of a batch that are in the array when they are encoded.
+// Every pixel ends up in the array: a pixel that differs from the one before
+// it is stored once it is encoded, and a run stores its pixel when it is
+// flushed, which happens before the next pixel is looked up. Storing each
+// pixel right after looking it up therefore finds the same pixels as
+// encoding one pixel at a time. The flush of an unfinished run comes before
+// any lookup in the batch, so its pixel is stored first.
+//
+// Runs are stored before they are flushed this way, which only changes the
+// slot of a pixel that the next lookup or the end of the image stores anyway.
+static void qoi_encoder_look_up_batch(QoiEncoder *encoder, const QoiPixel *pixels, const guint8 *hashes, bool *is_indexed, guint32 count) {
+	QoiPixel *array = encoder->array;
+	if (encoder->run != 0) {
+		array[qoi_pixel_hash(encoder->previous_pixel)] = encoder->previous_pixel;
+	}
+
+	for (guint32 i = 0; i < count; ++i) {
+		guint32 stored;
+		guint32 pixel;
+		memcpy(&stored, &array[hashes[i]], sizeof(stored));
+		memcpy(&pixel, &pixels[i], sizeof(pixel));
+		is_indexed[i]    = stored == pixel;
+		array[hashes[i]] = pixels[i];
+	}
+}
+
+// Pixels are encoded in batches. The hashes of a batch are computed in a
+// loop without dependencies between pixels, which the compiler can
+// vectorize, and looked up before the batch is encoded, so choosing a chunk
+// doesn't wait on the array.
+static void qoi_encoder_encode_pixels(QoiEncoder *encoder, const QoiPixel *pixels, guint32 count) {
+	QoiPixel batch[QOI_ENCODER_BATCH_SIZE];
+	guint8   hashes[QOI_ENCODER_BATCH_SIZE];
+	bool     is_indexed[QOI_ENCODER_BATCH_SIZE];
+
+	// Without an alpha channel the decoder keeps the alpha it starts with,
+	// so the encoder has to do the same for the hashes to agree.
+	guint8 alpha = encoder->has_alpha ? 0 : 255;
+
+	for (guint32 batch_start = 0; batch_start < count; batch_start += QOI_ENCODER_BATCH_SIZE) {
+		guint32 batch_size = MIN(count - batch_start, QOI_ENCODER_BATCH_SIZE);
+
+		for (guint32 i = 0; i < batch_size; ++i) {
+			batch[i]        = pixels[batch_start + i];
+			batch[i].alpha |= alpha;
+			hashes[i]       = qoi_pixel_hash(batch[i]);
+		}
+		qoi_encoder_look_up_batch(encoder, batch, hashes, is_indexed, batch_size);
+
+		for (guint32 pixel_index = 0; pixel_index < batch_size; ++pixel_index) {
+			QoiPixel current_pixel = batch[pixel_index];
+
+			if (qoi_pixel_equal(encoder->previous_pixel, current_pixel)) {
+				if (++encoder->run == QOI_MAX_RUN_LENGTH) {
+					qoi_encoder_flush_run(encoder);
+				}
+				continue;
+			}
+
+			qoi_encoder_flush_run(encoder);
+			qoi_encoder_reserve(encoder, QOI_MAX_BYTES_PER_PIXEL);
+
+			QoiPixel previous_pixel = encoder->previous_pixel;
+			guint8  *file_data      = encoder->buffer;
+			gsize    file_index     = encoder->buffer_index;
+
+			if (is_indexed[pixel_index]) {
+				file_data[file_index++] = QOI_OP_INDEX | hashes[pixel_index];
+			} else if (current_pixel.alpha == previous_pixel.alpha) {
+				gint32 dr = (gint32) (current_pixel.red   - previous_pixel.red);
+				gint32 dg = (gint32) (current_pixel.green - previous_pixel.green);
+				gint32 db = (gint32) (current_pixel.blue  - previous_pixel.blue);
+				gint32 dr_dg = dr - dg;
+				gint32 db_dg = db - dg;
+
+				if (
+					QOI_DIFF_LOWER_BOUND <= dr && dr <= QOI_DIFF_UPPER_BOUND &&
+					QOI_DIFF_LOWER_BOUND <= dg && dg <= QOI_DIFF_UPPER_BOUND &&
+					QOI_DIFF_LOWER_BOUND <= db && db <= QOI_DIFF_UPPER_BOUND
+				) {
+					file_data[file_index++] =
+						QOI_OP_DIFF |
+						((dr - QOI_DIFF_LOWER_BOUND) << 4) |
+						((dg - QOI_DIFF_LOWER_BOUND) << 2) |
+						((db - QOI_DIFF_LOWER_BOUND) << 0);
+				} else if (
+					QOI_LUMA_GREEN_LOWER_BOUND <= dg && dg <= QOI_LUMA_GREEN_UPPER_BOUND &&
+					QOI_LUMA_RED_BLUE_LOWER_BOUND <= dr_dg && dr_dg <= QOI_LUMA_RED_BLUE_UPPER_BOUND &&
+					QOI_LUMA_RED_BLUE_LOWER_BOUND <= db_dg && db_dg <= QOI_LUMA_RED_BLUE_UPPER_BOUND
+				) {
+					file_data[file_index++] = QOI_OP_LUMA | (dg - QOI_LUMA_GREEN_LOWER_BOUND);
+					file_data[file_index++] =
+						((dr_dg - QOI_LUMA_RED_BLUE_LOWER_BOUND) << 4) |
+						((db_dg - QOI_LUMA_RED_BLUE_LOWER_BOUND) << 0);
+				} else {
+					file_data[file_index++] = QOI_OP_RGB;
+					file_data[file_index++] = current_pixel.red;
+					file_data[file_index++] = current_pixel.green;
+					file_data[file_index++] = current_pixel.blue;
+				}
+			} else {
+				file_data[file_index++] = QOI_OP_RGBA;
+				file_data[file_index++] = current_pixel.red;
+				file_data[file_index++] = current_pixel.green;
+				file_data[file_index++] = current_pixel.blue;
+				file_data[file_index++] = current_pixel.alpha;
+			}
+
+			encoder->previous_pixel = current_pixel;
+			encoder->buffer_index   = file_index;
+		}
+	}
+}
+
+// Encodes count copies of the same pixel without looking at each of them.
+// Everything after the first pixel is a run, so the chunks can be written
+// directly.
+static void qoi_encoder_encode_repeated(QoiEncoder *encoder, QoiPixel pixel, guint64 count) {
+	if (count == 0) {
+		return;
+	}
+
+	if (!encoder->has_alpha) {
+		pixel.alpha = 255;
+	}
+
+	if (!qoi_pixel_equal(encoder->previous_pixel, pixel)) {
+		qoi_encoder_encode_pixels(encoder, &pixel, 1);
+		--count;
+	}
+
+	guint64 total = encoder->run + count;
+	if (total < QOI_MAX_RUN_LENGTH) {
+		encoder->run = total;
+		return;
+	}
+
+	guint64 full_runs = total / QOI_MAX_RUN_LENGTH;
+	while (full_runs != 0) {
+		qoi_encoder_reserve(encoder, 1);
+		gsize size = MIN(full_runs, QOI_WRITE_BUFFER_SIZE - encoder->buffer_index);
+		memset(&encoder->buffer[encoder->buffer_index], QOI_OP_RUN | (QOI_MAX_RUN_LENGTH - 1), size);
+		encoder->buffer_index += size;
+		full_runs -= size;
+	}
+	encoder->array[qoi_pixel_hash(pixel)] = pixel;
+	encoder->run = total % QOI_MAX_RUN_LENGTH;
+}
+
+static bool qoi_encoder_end(QoiEncoder *encoder) {
+	qoi_encoder_flush_run(encoder);
+
+	qoi_encoder_reserve(encoder, QOI_END_MARKER_SIZE);
+	memcpy(&encoder->buffer[encoder->buffer_index], QOI_END_MARKER, QOI_END_MARKER_SIZE);
+	encoder->buffer_index += QOI_END_MARKER_SIZE;
+
+	qoi_encoder_flush(encoder);
+
+	return !encoder->failed;
+}
+
+// Decodes the data an encoder writes on a thread of its own while the encoder
+// is still running, and compares every decoded row with the row of the image
+// it was encoded from. The encoder only has to copy its buffer into the queue
+// when it flushes, so checking the file costs close to no time when there is
+// a core to spare. An empty chunk marks the end of the data.
+typedef struct {
+	QoiImage     image;
+	GAsyncQueue *queue;
+	GThread     *thread;
+} QoiVerifier;
+
+static gpointer qoi_verifier_run(gpointer data) {
+	QoiVerifier *verifier = data;
+	QoiImage     image    = verifier->image;
+	QoiImage     file     = qoi_image_oriented(image);
+
+	GByteArray *pending    = g_byte_array_new();
+	QoiPixel   *row        = g_new(QoiPixel, file.width);
+	QoiPixel   *expected   = g_new(QoiPixel, file.width);
+	bool        has_header = false;
+	bool        matches    = true;
+	guint32     y          = 0;
+	gsize       written    = 0;
+
+	QoiDecoder decoder;
+	qoi_decoder_begin(&decoder, file.width, image.has_alpha, 0);
+
+	while (true) {
+		GBytes *chunk = g_async_queue_pop(verifier->queue);
+		gsize   chunk_size;
+		const guint8 *chunk_data = g_bytes_get_data(chunk, &chunk_size);
+
+		// After a mismatch the rest of the data is only taken off the queue,
+		// so the encoder never waits on the verifier.
+		if (matches) {
+			g_byte_array_append(pending, chunk_data, chunk_size);
+		}
+		g_bytes_unref(chunk);
+		if (chunk_size == 0) {
+			break;
+		}
+		if (!matches) {
+			continue;
+		}
+
+		gsize position = 0;
+		if (!has_header) {
+			if (pending->len < QOI_HEADER_SIZE) {
+				continue;
+			}
+			QoiHeader header = qoi_header_from_image(image);
+			matches    = memcmp(pending->data, &header, QOI_HEADER_SIZE) == 0;
+			has_header = true;
+			position   = QOI_HEADER_SIZE;
+		}
+
+		while (matches && y < file.height) {
+			gsize decoded = qoi_decoder_decode(&decoder, pending->data, pending->len, &position, &row[written], file.width - written);
+			if (decoded == 0) {
+				break;
+			}
+
+			written += decoded;
+			if (written == file.width) {
+				qoi_image_file_row(image, y, expected);
+				matches = memcmp(row, expected, file.width * sizeof(*row)) == 0;
+				written = 0;
+				++y;
+			}
+		}
+
+		g_byte_array_remove_range(pending, 0, position);
+	}
+
+	// Chunks are only decoded while there are QOI_MAX_BYTES_PER_PIXEL bytes
+	// left, which the end marker guarantees for the last chunk, so every row
+	// has been decoded by now and only the end marker is left.
+	matches = (
+		matches &&
+		y == file.height &&
+		decoder.run == 0 &&
+		pending->len == QOI_END_MARKER_SIZE &&
+		memcmp(pending->data, QOI_END_MARKER, QOI_END_MARKER_SIZE) == 0
+	);
+
+	g_free(expected);
+	g_free(row);
+	g_byte_array_unref(pending);
+
+	return GINT_TO_POINTER(matches);
+}
+
+static void qoi_verifier_start(QoiVerifier *verifier, QoiImage image) {
+	verifier->image  = image;
+	verifier->queue  = g_async_queue_new_full((GDestroyNotify) g_bytes_unref);
+	verifier->thread = g_thread_new("qoi-verify", qoi_verifier_run, verifier);
+}
+
+// Returns true when the data that was pushed decodes to the image.
+static bool qoi_verifier_finish(QoiVerifier *verifier) {
+	g_async_queue_push(verifier->queue, g_bytes_new(0, 0));
+	bool matches = GPOINTER_TO_INT(g_thread_join(verifier->thread));
+	g_async_queue_unref(verifier->queue);
+	return matches;
+}
+
+// The only reason the GIMP API is used in this function is to indicate
+// progress to the user. Updating the progress for every pixel would slow down
+// saving a lot, so it is only updated when we have encoded one row of pixels.
+// Progress and messages can only be reported from the main thread, so they can
+// be turned off for images that are saved from other threads.
+//
+// Everything outside of the content rectangle is transparent and is written
+// as runs, so the cost of saving depends on the content and not on the size
+// of the canvas.
+//
+// A verified save writes to a temporary file next to the destination, which
+// only replaces the destination once the written data has been decoded back
+// to the pixels of the image.
+//
+// Turning the image and premultiplying its alpha happen on each row as it is
+// encoded. A vertical flip encodes the rows from the bottom up, so no part of
+// the image is copied in advance.
+static bool save_image(QoiImage image, const gchar *filename, bool show_progress, bool verify) {
+	if (show_progress) {
+		gimp_progress_init_printf("Exporting '%s'", filename);
+	}
+
+	gchar *temporary_filename = 0;
+	FILE  *fd                 = 0;
+	if (verify) {
+		temporary_filename = g_strdup_printf("%s.XXXXXX", filename);
+		gint descriptor = g_mkstemp_full(temporary_filename, O_WRONLY, 0666);
+		if (descriptor != -1) {
+			fd = fdopen(descriptor, "wb");
+			if (!fd) {
+				close(descriptor);
+				g_unlink(temporary_filename);
+			}
+		}
+	} else {
+		fd = fopen(filename, "wb");
+	}
+
+	if (!fd) {
+		g_free(temporary_filename);
+		return false;
+	}
+
+	QoiEncoder *encoder = g_try_new(QoiEncoder, 1);
+	if (!encoder) {
+		fclose(fd);
+		if (temporary_filename) {
+			g_unlink(temporary_filename);
+			g_free(temporary_filename);
+		}
+		return false;
+	}
+
+	// A turned or premultiplied row is put together right before it is
+	// encoded, in one of two buffers so that the row before it is still
+	// around to be compared with.
+	QoiImage  file = qoi_image_oriented(image);
+	QoiPixel *rows = 0;
+	if (qoi_image_is_transformed(image) && file.content_width != 0) {
+		rows = g_try_new(QoiPixel, (gsize) file.content_width * 2);
+		if (!rows) {
+			g_free(encoder);
+			fclose(fd);
+			if (temporary_filename) {
+				g_unlink(temporary_filename);
+				g_free(temporary_filename);
+			}
+			return false;
+		}
+	}
+
+	QoiVerifier verifier;
+	if (verify) {
+		qoi_verifier_start(&verifier, image);
+	}
+
+	qoi_encoder_begin(encoder, fd, image, verify ? verifier.queue : 0);
+
+	QoiPixel background  = { .alpha = image.has_alpha ? 0 : 255 };
+	guint64  pixel_count = (guint64) file.width * file.height;
+
+	if (file.content_width == 0 || file.content_height == 0) {
+		qoi_encoder_encode_repeated(encoder, background, pixel_count);
+	} else {
+		guint32 margin = file.width - file.content_width;
+		guint64 before = (guint64) file.content_y * file.width + file.content_x;
+		guint64 after  = pixel_count - before - (guint64) (file.content_height - 1) * file.width - file.content_width;
+
+		// The chunks of each row and the margin after it are recorded along
+		// with the state of the encoder before the row. A row that has the
+		// same pixels as the row before it and starts from the same state
+		// would be encoded to the same chunks, so they are written again
+		// instead.
+		GByteArray     *row_chunks   = g_byte_array_new();
+		QoiEncoderState row_state;
+		const QoiPixel *previous_row = 0;
+
+		qoi_encoder_encode_repeated(encoder, background, before);
+		for (guint32 y = 0; y < file.content_height; ++y) {
+			const QoiPixel *pixels = &image.pixels[(gsize) y * image.content_width];
+			if (rows) {
+				QoiPixel *row = &rows[(gsize) (y % 2) * file.content_width];
+				qoi_image_content_row(image, y, row);
+				pixels = row;
+			}
+
+			// The right margin of this row and the left margin of the next row
+			// are next to each other in the stream.
+			bool has_margin = y + 1 < file.content_height;
+			if (
+				has_margin &&
+				previous_row &&
+				memcmp(pixels, previous_row, file.content_width * sizeof(*pixels)) == 0 &&
+				qoi_encoder_has_state(encoder, &row_state)
+			) {
+				qoi_encoder_write(encoder, row_chunks->data, row_chunks->len);
+			} else if (has_margin) {
+				qoi_encoder_save_state(encoder, &row_state);
+				qoi_encoder_record_begin(encoder, row_chunks);
+				qoi_encoder_encode_pixels(encoder, pixels, file.content_width);
+				qoi_encoder_encode_repeated(encoder, background, margin);
+				qoi_encoder_record_end(encoder);
+			} else {
+				qoi_encoder_encode_pixels(encoder, pixels, file.content_width);
+			}
+			previous_row = pixels;
+
+			if (show_progress) {
+				qoi_progress_update((gdouble) y / (gdouble) file.content_height);
+			}
+		}
+		qoi_encoder_encode_repeated(encoder, background, after);
+
+		g_byte_array_unref(row_chunks);
+	}
+
+	bool success = qoi_encoder_end(encoder);
+	g_free(encoder);
+	g_free(rows);
+
+	QoiPhase previous = qoi_trace_enter(QOI_PHASE_IO);
+	if (fclose(fd) != 0) {
+		success = false;
+	}
+	qoi_trace_enter(previous);
+
+	if (verify) {
+		if (!qoi_verifier_finish(&verifier)) {
+			if (show_progress) {
+				g_message("The data written to '%s' does not decode to the exported image.", filename);
+			}
+			success = false;
+		}
+
+		if (!success || g_rename(temporary_filename, filename) != 0) {
+			g_unlink(temporary_filename);
+			success = false;
+		}
+		g_free(temporary_filename);
+	}
+
+	if (show_progress) {
+		gimp_progress_end();
+	}
+
+	return success;
+}
+
+#define DATE "2022"
+#define LOAD_PROC "file-qoi-load"
+#define SAVE_PROC "file-qoi-save"
+#define BATCH_EXPORT_PROC "file-qoi-batch-export"
+#define BENCHMARK_PROC "file-qoi-benchmark"
+#define WATCH_PROC "file-qoi-watch"
+
+#define BATCH_EXPORT_DEFAULT_MEMORY_LIMIT 512
+#define BENCHMARK_DEFAULT_MAX_SIZE 4096
+#define BENCHMARK_DEFAULT_REPEATS 3
+#define WATCH_DEFAULT_INTERVAL 500
+
+// What a batch export does with drawables whose pixels are the same as those
+// of a drawable that was exported earlier in the same batch.
+typedef enum {
+	QOI_DEDUP_NONE = 0,
+	QOI_DEDUP_REFLINK,
+	QOI_DEDUP_HARD_LINK,
+	QOI_DEDUP_COUNT,
+} QoiDedupMode;
+
+typedef struct {
+	QoiColorspace colorspace;
+	bool          export_alpha;
+
+	// The largest width or height of the exported image. Larger images are
+	// scaled down when their pixels are fetched, 0 exports at full size.
+	guint32       max_size;
+
+	// Decode the file while it is written and only replace the destination
+	// when it decodes to the exported pixels.
+	bool          verify;
+
+	// How the image is turned in the file and whether its colors are
+	// premultiplied by alpha.
+	QoiOrientation orientation;
+	bool           premultiply;
+
+	// Export layers at the size of the canvas, with the area the layer
+	// doesn't cover left transparent, instead of at their own size.
+	bool           canvas_size;
+} QoiExportOptions;
+
+typedef enum {
+	QOI_LOAD_MODE_RGB = 0,
+	QOI_LOAD_MODE_SMALLEST,
+	QOI_LOAD_MODE_COUNT,
+} QoiLoadMode;
+
+// The precision of the created image. Images with more than 8 bits are
+// filled with samples in the native format of their layer, so that GIMP
+// doesn't have to convert them after loading.
+typedef enum {
+	QOI_LOAD_PRECISION_U8 = 0,
+	QOI_LOAD_PRECISION_U16_LINEAR,
+	QOI_LOAD_PRECISION_U16_PERCEPTUAL,
+	QOI_LOAD_PRECISION_FLOAT_LINEAR,
+	QOI_LOAD_PRECISION_FLOAT_PERCEPTUAL,
+	QOI_LOAD_PRECISION_COUNT,
+} QoiLoadPrecision;
+
+typedef struct {
+	bool        autocrop;
+	QoiLoadMode mode;
+
+	// Size in MiB of the cache of decoded pixels that is shared between runs
+	// of the plug-in, 0 turns the cache off.
+	guint32     cache_size;
+
+	QoiLoadPrecision precision;
+
+	// How the image in the file is turned in the layer and whether the
+	// colors in the file are premultiplied by alpha and have to be divided
+	// by it.
+	QoiOrientation orientation;
+	bool           unpremultiply;
+} QoiLoadOptions;
+
+// An image with a single plain layer doesn't need gimp_export_image to merge
+// it, even when the layer doesn't cover the canvas. get_qoi_image_from_gimp
+// places the layer on the canvas itself and only fetches the pixels that the
+// layer covers, while merging would create a canvas sized copy first. A
+// floating selection is left to gimp_export_image to anchor.
+static bool is_single_plain_layer(gint32 image, gint32 drawable) {
+	if (gimp_image_base_type(image) != GIMP_RGB || gimp_image_get_floating_sel(image) != -1) {
+		return false;
+	}
+
+	gint    layer_count = 0;
+	gint32 *layers      = gimp_image_get_layers(image, &layer_count);
+	bool    is_single   = layer_count == 1 && layers[0] == drawable;
+	g_free(layers);
+
+	if (!is_single) {
+		return false;
+	}
+
+	GimpLayerMode mode = gimp_layer_get_mode(drawable);
+	return (
+		!gimp_item_is_group(drawable) &&
+		gimp_item_get_visible(drawable) &&
+		gimp_layer_get_mask(drawable) == -1 &&
+		gimp_layer_get_opacity(drawable) == 100.0 &&
+		(mode == GIMP_LAYER_MODE_NORMAL || mode == GIMP_LAYER_MODE_NORMAL_LEGACY)
+	);
+}
+
+// Images whose visible layers are all plain normal layers can be composited by
+// the plug-in itself, which skips the copy of the image that
+// gimp_export_image merges in the core. Normal layers composite in linear
+// light and legacy ones in perceptual space, so layers of both kinds can't be
+// mixed. Anything else is left to gimp_export_image.
+static bool can_composite_layers(gint32 image, bool *is_legacy) {
+	if (gimp_image_base_type(image) != GIMP_RGB || gimp_image_get_floating_sel(image) != -1) {
+		return false;
+	}
+
+	gint    layer_count   = 0;
+	gint32 *layers        = gimp_image_get_layers(image, &layer_count);
+	gint    visible_count = 0;
+	gint    legacy_count  = 0;
+	bool    is_plain      = true;
+
+	for (gint i = 0; i < layer_count && is_plain; ++i) {
+		gint32 layer = layers[i];
+		if (!gimp_item_get_visible(layer)) {
+			continue;
+		}
+
+		GimpLayerMode          mode            = gimp_layer_get_mode(layer);
+		GimpLayerColorSpace    composite_space = gimp_layer_get_composite_space(layer);
+		GimpLayerCompositeMode composite_mode  = gimp_layer_get_composite_mode(layer);
+
+		is_plain = (
+			!gimp_item_is_group(layer) &&
+			gimp_layer_get_mask(layer) == -1 &&
+			(composite_mode == GIMP_LAYER_COMPOSITE_AUTO || composite_mode == GIMP_LAYER_COMPOSITE_UNION) &&
+			(
+				mode == GIMP_LAYER_MODE_NORMAL_LEGACY ||
+				(mode == GIMP_LAYER_MODE_NORMAL && (composite_space == GIMP_LAYER_COLOR_SPACE_AUTO || composite_space == GIMP_LAYER_COLOR_SPACE_RGB_LINEAR))
+			)
+		);
+
+		++visible_count;
+		if (mode == GIMP_LAYER_MODE_NORMAL_LEGACY) {
+			++legacy_count;
+		}
+	}
+	g_free(layers);
+
+	if (is_legacy) {
+		*is_legacy = legacy_count != 0;
+	}
+
+	return is_plain && visible_count != 0 && (legacy_count == 0 || legacy_count == visible_count);
+}
+
+// The options are in the same order as the enum, like the colorspaces.
+static GtkWidget *orientation_combo_new(QoiOrientation orientation) {
+	GtkWidget *combo = gtk_combo_box_text_new();
+	gtk_combo_box_text_insert_text(GTK_COMBO_BOX_TEXT(combo), QOI_ORIENTATION_NONE, "None");
+	gtk_combo_box_text_insert_text(GTK_COMBO_BOX_TEXT(combo), QOI_ORIENTATION_FLIP_HORIZONTAL, "Flip horizontally");
+	gtk_combo_box_text_insert_text(GTK_COMBO_BOX_TEXT(combo), QOI_ORIENTATION_FLIP_VERTICAL, "Flip vertically");
+	gtk_combo_box_text_insert_text(GTK_COMBO_BOX_TEXT(combo), QOI_ORIENTATION_ROTATE_90, "Rotate 90 degrees clockwise");
+	gtk_combo_box_text_insert_text(GTK_COMBO_BOX_TEXT(combo), QOI_ORIENTATION_ROTATE_180, "Rotate 180 degrees");
+	gtk_combo_box_text_insert_text(GTK_COMBO_BOX_TEXT(combo), QOI_ORIENTATION_ROTATE_270, "Rotate 90 degrees counter-clockwise");
+	gtk_combo_box_set_active(GTK_COMBO_BOX(combo), orientation);
+	return combo;
+}
+
+static GimpExportReturn show_export_dialog(gint32 *image, gint32 *drawable, QoiExportOptions *options) {
+	GimpExportReturn export = GIMP_EXPORT_IGNORE;
+
+	gimp_get_data(SAVE_PROC, options);
+
+	gimp_ui_init("file-qoi", 0);
+
+	if (!is_single_plain_layer(*image, *drawable) && !can_composite_layers(*image, 0)) {
+		export = gimp_export_image(image, drawable, "QOI", GIMP_EXPORT_CAN_HANDLE_RGB | GIMP_EXPORT_CAN_HANDLE_ALPHA);
+	}
+
+	GtkWidget *dialog = gimp_export_dialog_new("QOI", "export", 0);
+	gtk_window_set_resizable(GTK_WINDOW(dialog), false);
+
+	GtkWidget *vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 12);
+	gtk_container_set_border_width(GTK_CONTAINER(vbox), 12);
+	gtk_box_pack_start(GTK_BOX(gimp_export_dialog_get_content_area(dialog)), vbox, true, true, 0);
+	gtk_widget_show(vbox);
+
+	GtkWidget *toggle = gtk_check_button_new_with_label("Export alpha");
+	gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(toggle), options->export_alpha);
+	gtk_container_add(GTK_CONTAINER(vbox), toggle);
+	gtk_widget_show(toggle);
+
+	GtkWidget *label = gtk_label_new("Colorspace:");
+	gtk_label_set_xalign(GTK_LABEL(label), 0);
+	gtk_container_add(GTK_CONTAINER(vbox), label);
+	gtk_widget_show(label);
+
+	// As colorspaces are enumerated from 0, if the options are in the same
+	// order as they are in the enum, the active index will match the
+	// colorspace. If the values for colorspaces changes for future versions of
+	// the format, this can change to something more complicated.
+	GtkWidget *combo = gtk_combo_box_text_new();
+	gtk_combo_box_text_insert_text(GTK_COMBO_BOX_TEXT(combo), QOI_COLORSPACE_SRGB, "SRGB");
+	gtk_combo_box_text_insert_text(GTK_COMBO_BOX_TEXT(combo), QOI_COLORSPACE_LINEAR, "Linear");
+
+	// Set one element as active so there is always a valid colorspace selected
+	gtk_combo_box_set_active(GTK_COMBO_BOX(combo), options->colorspace);
+	gtk_container_add(GTK_CONTAINER(vbox), combo);
+	gtk_widget_show(combo);
+
+	GtkWidget *size_label = gtk_label_new("Maximum width or height (0 for full size):");
+	gtk_label_set_xalign(GTK_LABEL(size_label), 0);
+	gtk_container_add(GTK_CONTAINER(vbox), size_label);
+	gtk_widget_show(size_label);
+
+	GtkWidget *size_spin = gtk_spin_button_new_with_range(0, GIMP_MAX_IMAGE_SIZE, 1);
+	gtk_spin_button_set_value(GTK_SPIN_BUTTON(size_spin), options->max_size);
+	gtk_container_add(GTK_CONTAINER(vbox), size_spin);
+	gtk_widget_show(size_spin);
+
+	GtkWidget *verify_toggle = gtk_check_button_new_with_label("Verify the written file");
+	gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(verify_toggle), options->verify);
+	gtk_container_add(GTK_CONTAINER(vbox), verify_toggle);
+	gtk_widget_show(verify_toggle);
+
+	GtkWidget *orientation_label = gtk_label_new("Orientation in the file:");
+	gtk_label_set_xalign(GTK_LABEL(orientation_label), 0);
+	gtk_container_add(GTK_CONTAINER(vbox), orientation_label);
+	gtk_widget_show(orientation_label);
+
+	GtkWidget *orientation_combo = orientation_combo_new(options->orientation);
+	gtk_container_add(GTK_CONTAINER(vbox), orientation_combo);
+	gtk_widget_show(orientation_combo);
+
+	GtkWidget *premultiply_toggle = gtk_check_button_new_with_label("Premultiply colors by alpha");
+	gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(premultiply_toggle), options->premultiply);
+	gtk_container_add(GTK_CONTAINER(vbox), premultiply_toggle);
+	gtk_widget_show(premultiply_toggle);
+
+	gint response = gtk_dialog_run(GTK_DIALOG(dialog));
+	if (response == GTK_RESPONSE_CANCEL) {
+		export = GIMP_EXPORT_CANCEL;
+	}
+
+	options->export_alpha = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(toggle));
+	options->colorspace = gtk_combo_box_get_active(GTK_COMBO_BOX(combo));
+	options->max_size = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(size_spin));
+	options->verify = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(verify_toggle));
+	options->orientation = gtk_combo_box_get_active(GTK_COMBO_BOX(orientation_combo));
+	options->premultiply = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(premultiply_toggle));
+
+	gtk_widget_destroy(dialog);
+
+	gimp_set_data(SAVE_PROC, options, sizeof(*options));
+
+	return export;
+}
+
+// Picks the image type that needs the least memory while still representing
+// every pixel exactly. Indexed images always use an sRGB colormap, only
+// support alpha that is either on or off and only exist at 8-bit precision.
+static GimpImageBaseType choose_base_type(QoiImage qoi_image, const QoiDecodeStats *stats, QoiLoadMode mode, QoiLoadPrecision precision) {
+	if (mode == QOI_LOAD_MODE_SMALLEST) {
+		if (stats->is_gray) {
+			return GIMP_GRAY;
+		}
+
+		if (
+			stats->color_count <= QOI_MAX_PALETTE_SIZE &&
+			!stats->has_partial_alpha &&
+			qoi_image.colorspace == QOI_COLORSPACE_SRGB &&
+			precision == QOI_LOAD_PRECISION_U8
+		) {
+			return GIMP_INDEXED;
+		}
+	}
+
+	return GIMP_RGB;
+}
+
+// The pixels that go into the layer of a loaded image: the cropped part of
+// the decoded image, turned and with its colors divided by alpha when that is
+// asked for. Rows that need neither are read from the decoded image as they
+// are, others are put together in a buffer of a single row.
+typedef struct {
+	const QoiPixel *pixels;
+	gsize           stride;
+	guint32         width;
+	guint32         height;
+	QoiOrientation  orientation;
+	bool            unpremultiply;
+} QoiLayerSource;
+
+static QoiLayerSource qoi_layer_source_init(QoiImage qoi_image, GeglRectangle crop, QoiLoadOptions options) {
+	return (QoiLayerSource) {
+		.pixels        = &qoi_image.pixels[(gsize) crop.y * qoi_image.width + crop.x],
+		.stride        = qoi_image.width,
+		.width         = crop.width,
+		.height        = crop.height,
+		.orientation   = options.orientation,
+		.unpremultiply = options.unpremultiply && qoi_image.has_alpha,
+	};
+}
+
+static bool qoi_layer_source_is_transformed(const QoiLayerSource *source) {
+	return source->orientation != QOI_ORIENTATION_NONE || source->unpremultiply;
+}
+
+static guint32 qoi_layer_source_row_length(const QoiLayerSource *source) {
+	return qoi_orientation_swaps_sides(source->orientation) ? source->height : source->width;
+}
+
+// Returns row y of the layer, which is put together in scratch when it has
+// to be.
+static const QoiPixel *qoi_layer_source_row(const QoiLayerSource *source, guint32 y, QoiPixel *scratch) {
+	if (!qoi_layer_source_is_transformed(source)) {
+		return &source->pixels[(gsize) y * source->stride];
+	}
+
+	qoi_orient_row(source->pixels, source->stride, source->width, source->height, source->orientation, y, scratch);
+	if (source->unpremultiply) {
+		qoi_unpremultiply_row(scratch, qoi_layer_source_row_length(source));
+	}
+	return scratch;
+}
+
+// Grayscale and indexed layers are filled one row at a time from a buffer of
+// converted pixels, the conversion is cheap next to the transfer itself.
+static void convert_row(const QoiPixel *pixels, guint32 count, GimpImageBaseType base_type, bool has_alpha, const QoiDecodeStats *stats, guint8 *result) {
+	gsize result_index = 0;
+	for (guint32 i = 0; i < count; ++i) {
+		QoiPixel pixel = pixels[i];
+		if (base_type == GIMP_GRAY) {
+			result[result_index++] = pixel.red;
+		} else {
+			guint slot;
+			result[result_index++] = qoi_decode_stats_find_color(stats, pixel, &slot);
+		}
+
+		if (has_alpha) {
+			result[result_index++] = pixel.alpha;
+		}
+	}
+}
+
+#define QOI_CONVERT_BAND_HEIGHT 64
+
+// Every 8-bit sample maps to one sample of the layer, so the conversion is a
+// table lookup per sample. Color samples go through the transfer function of
+// the layer when it differs from the one of the file, alpha is always linear.
+typedef struct {
+	bool    is_float;
+	bool    is_gray;
+	bool    has_alpha;
+	guint   channels;
+	guint16 color_u16[256];
+	guint16 alpha_u16[256];
+	gfloat  color_float[256];
+	gfloat  alpha_float[256];
+} QoiSampleTables;
+
+static gdouble srgb_to_linear(gdouble value) {
+	return value <= 0.04045 ? value / 12.92 : pow((value + 0.055) / 1.055, 2.4);
+}
+
+static gdouble linear_to_srgb(gdouble value) {
+	return value <= 0.0031308 ? value * 12.92 : 1.055 * pow(value, 1.0 / 2.4) - 0.055;
+}
+
+static void qoi_sample_tables_init(QoiSampleTables *tables, QoiLoadPrecision precision, QoiColorspace colorspace, GimpImageBaseType base_type, bool has_alpha) {
+	bool is_linear = precision == QOI_LOAD_PRECISION_U16_LINEAR || precision == QOI_LOAD_PRECISION_FLOAT_LINEAR;
+
+	tables->is_float  = precision == QOI_LOAD_PRECISION_FLOAT_LINEAR || precision == QOI_LOAD_PRECISION_FLOAT_PERCEPTUAL;
+	tables->is_gray   = base_type == GIMP_GRAY;
+	tables->has_alpha = has_alpha;
+	tables->channels  = (tables->is_gray ? 1 : 3) + (has_alpha ? 1 : 0);
+
+	for (guint i = 0; i < 256; ++i) {
+		gdouble value = i / 255.0;
+		if (is_linear && colorspace == QOI_COLORSPACE_SRGB) {
+			value = srgb_to_linear(value);
+		} else if (!is_linear && colorspace == QOI_COLORSPACE_LINEAR) {
+			value = linear_to_srgb(value);
+		}
+
+		tables->color_u16[i]   = round(value * 65535.0);
+		tables->alpha_u16[i]   = i * 257;
+		tables->color_float[i] = value;
+		tables->alpha_float[i] = i / 255.0f;
+	}
+}
+
+// Builds the name of the babl format that matches the samples produced with
+// the tables, which is also the native format of the layer.
+static const Babl *qoi_sample_tables_format(const QoiSampleTables *tables, QoiLoadPrecision precision) {
+	bool is_linear = precision == QOI_LOAD_PRECISION_U16_LINEAR || precision == QOI_LOAD_PRECISION_FLOAT_LINEAR;
+
+	const gchar *model = 0;
+	if (tables->is_gray) {
+		model = is_linear ? "Y" : "Y'";
+	} else {
+		model = is_linear ? "RGB" : "R'G'B'";
+	}
+
+	gchar      *name   = g_strdup_printf("%s%s %s", model, tables->has_alpha ? "A" : "", tables->is_float ? "float" : "u16");
+	const Babl *format = babl_format(name);
+	g_free(name);
+	return format;
+}
+
+static gsize qoi_sample_tables_pixel_size(const QoiSampleTables *tables) {
+	return tables->channels * (tables->is_float ? sizeof(gfloat) : sizeof(guint16));
+}
+
+typedef struct {
+	const QoiLayerSource  *source;
+	const QoiSampleTables *tables;
+	GeglRectangle          band;
+	guint8                *samples;
+	bool                   done;
+} QoiConvertJob;
+
+// Shared between the main thread, which hands the converted bands to GEGL in
+// order, and the threads converting them.
+typedef struct {
+	GMutex mutex;
+	GCond  done;
+} QoiConvert;
+
+static void convert_band_worker(gpointer data, gpointer user_data) {
+	QoiConvertJob         *job     = data;
+	QoiConvert            *convert = user_data;
+	const QoiSampleTables *tables  = job->tables;
+	GeglRectangle          band    = job->band;
+
+	QoiPixel *scratch = 0;
+	if (qoi_layer_source_is_transformed(job->source)) {
+		scratch = g_new(QoiPixel, band.width);
+	}
+
+	for (gint y = 0; y < band.height; ++y) {
+		const QoiPixel *pixels    = qoi_layer_source_row(job->source, band.y + y, scratch);
+		gsize           row_index = (gsize) y * band.width * tables->channels;
+
+		if (tables->is_float) {
+			gfloat *row = (gfloat *) job->samples + row_index;
+			for (gint x = 0; x < band.width; ++x) {
+				QoiPixel pixel = pixels[x];
+				*row++ = tables->color_float[pixel.red];
+				if (!tables->is_gray) {
+					*row++ = tables->color_float[pixel.green];
+					*row++ = tables->color_float[pixel.blue];
+				}
+				if (tables->has_alpha) {
+					*row++ = tables->alpha_float[pixel.alpha];
+				}
+			}
+		} else {
+			guint16 *row = (guint16 *) job->samples + row_index;
+			for (gint x = 0; x < band.width; ++x) {
+				QoiPixel pixel = pixels[x];
+				*row++ = tables->color_u16[pixel.red];
+				if (!tables->is_gray) {
+					*row++ = tables->color_u16[pixel.green];
+					*row++ = tables->color_u16[pixel.blue];
+				}
+				if (tables->has_alpha) {
+					*row++ = tables->alpha_u16[pixel.alpha];
+				}
+			}
+		}
+	}
+
+	g_free(scratch);
+
+	g_mutex_lock(&convert->mutex);
+	job->done = true;
+	g_cond_broadcast(&convert->done);
+	g_mutex_unlock(&convert->mutex);
+}
+
+// Bands of rows are converted in parallel while the main thread transfers the
+// bands that are done. Only a few bands per thread are in flight at once, so
+// the converted samples never take up more than a small multiple of a band.
+static bool transfer_converted_bands(const QoiLayerSource *source, GeglRectangle layer, const QoiSampleTables *tables, const Babl *format, GeglBuffer *buffer) {
+	gint  band_count = (layer.height + QOI_CONVERT_BAND_HEIGHT - 1) / QOI_CONVERT_BAND_HEIGHT;
+	gint  in_flight  = MIN(band_count, 2 * (gint) g_get_num_processors());
+	gsize band_size  = (gsize) layer.width * QOI_CONVERT_BAND_HEIGHT * qoi_sample_tables_pixel_size(tables);
+
+	guint8 *samples = g_try_malloc(band_size * in_flight);
+	if (!samples) {
+		return false;
+	}
+
+	QoiConvert convert;
+	g_mutex_init(&convert.mutex);
+	g_cond_init(&convert.done);
+
+	QoiConvertJob *jobs = g_new0(QoiConvertJob, band_count);
+	GThreadPool   *pool = g_thread_pool_new(convert_band_worker, &convert, g_get_num_processors(), false, 0);
+
+	gint submitted = 0;
+	for (gint i = 0; i < band_count; ++i) {
+		// A band reuses the samples of the band in_flight bands before it,
+		// which has been transfered by now.
+		while (submitted < band_count && submitted < i + in_flight) {
+			gint y = submitted * QOI_CONVERT_BAND_HEIGHT;
+			jobs[submitted] = (QoiConvertJob) {
+				.source  = source,
+				.tables  = tables,
+				.band    = { 0, y, layer.width, MIN(QOI_CONVERT_BAND_HEIGHT, layer.height - y) },
+				.samples = &samples[band_size * (submitted % in_flight)],
+			};
+			g_thread_pool_push(pool, &jobs[submitted], 0);
+			++submitted;
+		}
+
+		g_mutex_lock(&convert.mutex);
+		while (!jobs[i].done) {
+			g_cond_wait(&convert.done, &convert.mutex);
+		}
+		g_mutex_unlock(&convert.mutex);
+
+		// This procedure doesn't indicate if it fails, it just doesn't put any pixels in the image.
+		gegl_buffer_set(
+			buffer,
+			GEGL_RECTANGLE(0, jobs[i].band.y, layer.width, jobs[i].band.height), 0,
+			format, jobs[i].samples,
+			GEGL_AUTO_ROWSTRIDE
+		);
+		qoi_progress_update((gdouble) (i + 1) / (gdouble) band_count);
+	}
+
+	g_thread_pool_free(pool, false, true);
+	g_free(jobs);
+	g_cond_clear(&convert.done);
+	g_mutex_clear(&convert.mutex);
+	g_free(samples);
+
+	return true;
+}
+
+// Only the pixels inside of crop are transfered to the layer, which is placed
+// at the same position in the image. When the image is turned, the layer is
+// turned along with the canvas.
+static gint32 create_gimp_image_from_qoi_image(QoiImage qoi_image, GeglRectangle crop, GimpImageBaseType base_type, QoiLoadOptions options, const QoiDecodeStats *stats, const gchar *filename) {
+	// Layers only need to be deleted they are not added to an image. If they
+	// are added to an image, deleting the image will delete the layer as well.
+	// This is why gimp_item_delete is only called at one of the points of
+	// failure, when the layer fails to attach to the image.
+
+	gimp_progress_init("Transfering pixels");
+
+	guint32 width        = qoi_image.width;
+	guint32 height       = qoi_image.height;
+	guint32 layer_x      = crop.x;
+	guint32 layer_y      = crop.y;
+	guint32 layer_width  = crop.width;
+	guint32 layer_height = crop.height;
+	qoi_orient_rectangle(options.orientation, width, height, &layer_x, &layer_y, &layer_width, &layer_height);
+	if (qoi_orientation_swaps_sides(options.orientation)) {
+		width  = qoi_image.height;
+		height = qoi_image.width;
+	}
+
+	QoiLayerSource source = qoi_layer_source_init(qoi_image, crop, options);
+
+	gint32 image = -1;
+	switch (options.precision) {
+		case QOI_LOAD_PRECISION_U8: image = gimp_image_new(width, height, base_type); break;
+		case QOI_LOAD_PRECISION_U16_LINEAR: image = gimp_image_new_with_precision(width, height, base_type, GIMP_PRECISION_U16_LINEAR); break;
+		case QOI_LOAD_PRECISION_U16_PERCEPTUAL: image = gimp_image_new_with_precision(width, height, base_type, GIMP_PRECISION_U16_GAMMA); break;
+		case QOI_LOAD_PRECISION_FLOAT_LINEAR: image = gimp_image_new_with_precision(width, height, base_type, GIMP_PRECISION_FLOAT_LINEAR); break;
+		case QOI_LOAD_PRECISION_FLOAT_PERCEPTUAL: image = gimp_image_new_with_precision(width, height, base_type, GIMP_PRECISION_FLOAT_GAMMA); break;
+		default: assert(!"Not reached!"); break;
+	}
+	if (image == -1) {
+		return -1;
+	}
+
+	gimp_image_set_filename(image, filename);
+
+	GimpImageType layer_type = 0;
+	switch (base_type) {
+		case GIMP_RGB: layer_type = qoi_image.has_alpha ? GIMP_RGBA_IMAGE : GIMP_RGB_IMAGE; break;
+		case GIMP_GRAY: layer_type = qoi_image.has_alpha ? GIMP_GRAYA_IMAGE : GIMP_GRAY_IMAGE; break;
+		case GIMP_INDEXED: {
+			guint8 colormap[QOI_MAX_PALETTE_SIZE * 3];
+			for (guint32 i = 0; i < stats->color_count; ++i) {
+				colormap[i * 3 + 0] = stats->palette[i].red;
+				colormap[i * 3 + 1] = stats->palette[i].green;
+				colormap[i * 3 + 2] = stats->palette[i].blue;
+			}
+			gimp_image_set_colormap(image, colormap, stats->color_count);
+
+			layer_type = qoi_image.has_alpha ? GIMP_INDEXEDA_IMAGE : GIMP_INDEXED_IMAGE;
+		} break;
+	}
+
+	gint32 layer = gimp_layer_new(
+		image,
+		"Background",
+		layer_width, layer_height,
+		layer_type,
+		100, GIMP_NORMAL_MODE
+	);
+	if (layer == -1) {
+		gimp_image_delete(image);
+		return -1;
+	}
+	gimp_layer_set_offsets(layer, layer_x, layer_y);
+
+	if (!gimp_image_insert_layer(image, layer, 0, 0)) {
+		gimp_item_delete(layer);
+		gimp_image_delete(image);
+		return -1;
+	}
+
+	GeglBuffer *buffer = gimp_drawable_get_buffer(layer);
+	if (!buffer) {
+		gimp_image_delete(image);
+		return -1;
+	}
+
+	if (options.precision != QOI_LOAD_PRECISION_U8) {
+		QoiSampleTables tables;
+		qoi_sample_tables_init(&tables, options.precision, qoi_image.colorspace, base_type, qoi_image.has_alpha);
+
+		GeglRectangle layer   = { 0, 0, layer_width, layer_height };
+		bool          success = transfer_converted_bands(&source, layer, &tables, qoi_sample_tables_format(&tables, options.precision), buffer);
+		g_object_unref(buffer);
+		if (!success) {
+			gimp_image_delete(image);
+			return -1;
+		}
+
+		gimp_progress_end();
+
+		return image;
+	}
+
+	const Babl *format = 0;
+	switch (base_type) {
+		case GIMP_RGB: {
+			switch (qoi_image.colorspace) {
+				case QOI_COLORSPACE_SRGB: format = babl_format("R~G~B~A u8"); break;
+				case QOI_COLORSPACE_LINEAR: format = babl_format("RGBA u8"); break;
+				default: assert(!"Not reached!"); break;
+			}
+		} break;
+		case GIMP_GRAY: {
+			switch (qoi_image.colorspace) {
+				case QOI_COLORSPACE_SRGB: format = babl_format(qoi_image.has_alpha ? "Y~A u8" : "Y~ u8"); break;
+				case QOI_COLORSPACE_LINEAR: format = babl_format(qoi_image.has_alpha ? "YA u8" : "Y u8"); break;
+				default: assert(!"Not reached!"); break;
+			}
+		} break;
+		case GIMP_INDEXED: {
+			format = gimp_drawable_get_format(layer);
+		} break;
+	}
+
+	guint8   *row     = 0;
+	QoiPixel *scratch = 0;
+	if (base_type != GIMP_RGB) {
+		row = g_try_malloc((gsize) layer_width * 2);
+	}
+	if (qoi_layer_source_is_transformed(&source)) {
+		scratch = g_try_new(QoiPixel, layer_width);
+	}
+	if ((base_type != GIMP_RGB && !row) || (qoi_layer_source_is_transformed(&source) && !scratch)) {
+		g_free(scratch);
+		g_free(row);
+		g_object_unref(buffer);
+		gimp_image_delete(image);
+		return -1;
+	}
+
+	// It is faster to do a single call to gegl_buffer_set, but to give users
+	// some feedback on what is happening, one call per row of pixels is perforemed and
+	// the progress is updated after each.
+	for (guint32 y = 0; y < layer_height; ++y) {
+		const QoiPixel *pixels = qoi_layer_source_row(&source, y, scratch);
+		const void     *data   = pixels;
+		if (row) {
+			convert_row(pixels, layer_width, base_type, qoi_image.has_alpha, stats, row);
+			data = row;
+		}
+
+		// This procedure doesn't indicate if it fails, it just doesn't put any pixels in the image.
+		gegl_buffer_set(
+			buffer,
+			GEGL_RECTANGLE(0, y, layer_width, 1), 0,
+			format, data,
+			GEGL_AUTO_ROWSTRIDE
+		);
+		qoi_progress_update((gdouble) y / (gdouble) layer_height);
+	}
+	g_free(scratch);
+	g_free(row);
+	g_object_unref(buffer);
+
+	gimp_progress_end();
+
+	return image;
+}
+
+// With canvas_size, layers are placed on the canvas of their image, other
+// drawables are always exported at their own size. Only the part of the
+// canvas covered by the drawable is fetched from GEGL, the rest is left for
+// save_image to fill in.
+//
+// When the image has to be scaled down, GEGL does the scaling while fetching,
+// which lets it use the mipmap levels of the buffer instead of reading every
+// pixel at full size.
+static bool get_qoi_image_from_gimp(gint32 image, gint32 drawable, QoiExportOptions options, QoiImage *result) {
+	gimp_progress_init("Transfering pixels");
+
+	result->colorspace = options.colorspace;
+	result->has_alpha = options.export_alpha;
+	result->orientation = options.orientation;
+	result->premultiply = options.premultiply;
+
+	GeglBuffer *buffer = gimp_drawable_get_buffer(drawable);
+	if (!buffer) {
+		return false;
+	}
+
+	GeglRectangle canvas  = { 0, 0, gegl_buffer_get_width(buffer), gegl_buffer_get_height(buffer) };
+	GeglRectangle extent  = canvas;
+	GeglRectangle content = canvas;
+	if (options.canvas_size && gimp_item_is_layer(drawable)) {
+		canvas.width  = gimp_image_width(image);
+		canvas.height = gimp_image_height(image);
+		gimp_drawable_offsets(drawable, &extent.x, &extent.y);
+		if (!gegl_rectangle_intersect(&content, &canvas, &extent)) {
+			content = (GeglRectangle) { 0 };
+		}
+	}
+
+	gdouble scale = 1.0;
+	if (options.max_size != 0 && (guint32) MAX(canvas.width, canvas.height) > options.max_size) {
+		scale = (gdouble) options.max_size / MAX(canvas.width, canvas.height);
+	}
+
+	// Where the content is fetched from in the scaled coordinates of the
+	// buffer. Edges are rounded to whole pixels at the scaled size.
+	gint source_x = content.x - extent.x;
+	gint source_y = content.y - extent.y;
+	if (scale != 1.0) {
+		gint x0 = round(content.x * scale);
+		gint y0 = round(content.y * scale);
+		gint x1 = round((content.x + content.width) * scale);
+		gint y1 = round((content.y + content.height) * scale);
+
+		source_x = round((content.x - extent.x) * scale);
+		source_y = round((content.y - extent.y) * scale);
+		content  = (GeglRectangle) { x0, y0, x1 - x0, y1 - y0 };
+		canvas.width  = MAX(1, round(canvas.width * scale));
+		canvas.height = MAX(1, round(canvas.height * scale));
+		gegl_rectangle_intersect(&content, &content, &canvas);
+	}
+
+	result->width          = canvas.width;
+	result->height         = canvas.height;
+	result->content_x      = content.x;
+	result->content_y      = content.y;
+	result->content_width  = content.width;
+	result->content_height = content.height;
+
+	result->pixels = g_try_malloc((gsize) result->content_width * result->content_height * sizeof(*result->pixels));
+	if (!result->pixels && result->content_width * result->content_height != 0) {
+		g_object_unref(buffer);
+		return false;
+	}
+
+	const Babl *format = 0;
+	switch (options.colorspace) {
+		case QOI_COLORSPACE_SRGB: format = babl_format("R~G~B~A u8"); break;
+		case QOI_COLORSPACE_LINEAR: format = babl_format("RGBA u8"); break;
+		default: assert(!"Not reached!"); break;
+	}
+
+	// It is faster to do a single call to gegl_buffer_get, but to give users
+	// some feedback on what is happening, one call per row of pixels is perforemed and
+	// the progress is updated after each.
+	for (guint32 y = 0; y < result->content_height; ++y) {
+		// This procedure doesn't indicate if it fails, it just doesn't put any pixels in the image.
+		gegl_buffer_get(
+			buffer,
+			GEGL_RECTANGLE(source_x, source_y + y, content.width, 1), scale,
+			format, &result->pixels[(gsize) y * result->content_width],
+			GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE
+		);
+		qoi_progress_update((gdouble) y / (gdouble) result->content_height);
+	}
+	g_object_unref(buffer);
+
+	gimp_progress_end();
+
+	return true;
+}
+
+#define QOI_COMPOSITE_BAND_HEIGHT 32
+#define QOI_COMPOSITE_MEMORY_LIMIT (256 * 1024 * 1024)
+
+// The part of one layer that covers a band, fetched as premultiplied floats.
+typedef struct {
+	GeglRectangle rect;
+	gfloat        opacity;
+	gfloat       *samples;
+} QoiCompositeLayer;
+
+typedef struct {
+	QoiImage          *result;
+	GeglRectangle      band;
+	QoiCompositeLayer *layers;
+	gint               layer_count;
+	const Babl        *fish;
+	bool               success;
+	bool               done;
+} QoiCompositeJob;
+
+// Shared between the thread fetching the layers and the threads compositing
+// them. Fetching waits for old bands to be done to keep the fetched samples
+// in memory below QOI_COMPOSITE_MEMORY_LIMIT.
+typedef struct {
+	GMutex mutex;
+	GCond  done;
+} QoiComposite;
+
+// With premultiplied samples "over" is the same operation on all four
+// channels, which lets the compiler vectorize the loop.
+static void composite_over(gfloat *restrict destination, const gfloat *restrict source, gsize count, gfloat opacity) {
+	for (gsize i = 0; i < count; ++i) {
+		gfloat coverage = 1.0f - source[i * 4 + 3] * opacity;
+		for (gsize channel = 0; channel < 4; ++channel) {
+			destination[i * 4 + channel] = source[i * 4 + channel] * opacity + destination[i * 4 + channel] * coverage;
+		}
+	}
+}
+
+static void composite_band_worker(gpointer data, gpointer user_data) {
+	QoiCompositeJob *job       = data;
+	QoiComposite    *composite = user_data;
+	GeglRectangle    band      = job->band;
+	gfloat          *result = g_try_new0(gfloat, (gsize) band.width * band.height * 4);
+
+	job->success = result != 0;
+	for (gint i = 0; i < job->layer_count; ++i) {
+		QoiCompositeLayer *layer = &job->layers[i];
+		for (gint y = 0; y < layer->rect.height && result; ++y) {
+			composite_over(
+				&result[((gsize) (layer->rect.y - band.y + y) * band.width + layer->rect.x - band.x) * 4],
+				&layer->samples[(gsize) y * layer->rect.width * 4],
+				layer->rect.width, layer->opacity
+			);
+		}
+		g_free(layer->samples);
+		layer->samples = 0;
+	}
+
+	// Bands span the width of the content, so their rows follow each other
+	// in the pixels of the result.
+	if (result) {
+		QoiPixel *pixels = &job->result->pixels[(gsize) (band.y - job->result->content_y) * job->result->content_width];
+		babl_process(job->fish, result, pixels, (glong) band.width * band.height);
+	}
+	g_free(result);
+
+	g_mutex_lock(&composite->mutex);
+	job->done = true;
+	g_cond_signal(&composite->done);
+	g_mutex_unlock(&composite->mutex);
+}
+
+// Composites the visible layers of an image that can_composite_layers accepts.
+// Layers are fetched one band at a time on the main thread, where the
+// connection to GIMP lives, while the bands that have been fetched are
+// composited and converted to the exported format on a pool of threads.
+//
+// Scaled exports fetch every layer at the reduced scale and composite those,
+// the same way that a single layer is fetched by get_qoi_image_from_gimp.
+static bool get_qoi_image_from_layers(gint32 image, QoiExportOptions options, bool is_legacy, QoiImage *result) {
+	gimp_progress_init("Compositing layers");
+
+	result->colorspace = options.colorspace;
+	result->has_alpha  = options.export_alpha;
+	result->orientation = options.orientation;
+	result->premultiply = options.premultiply;
+
+	GeglRectangle canvas = { 0, 0, gimp_image_width(image), gimp_image_height(image) };
+	gdouble       scale  = 1.0;
+	if (options.max_size != 0 && (guint32) MAX(canvas.width, canvas.height) > options.max_size) {
+		scale = (gdouble) options.max_size / MAX(canvas.width, canvas.height);
+		canvas.width  = MAX(1, round(canvas.width * scale));
+		canvas.height = MAX(1, round(canvas.height * scale));
+	}
+
+	// Visible layers from the bottom up, with their extents on the scaled
+	// canvas. The content is the part of the canvas that any of them covers.
+	gint           layer_count = 0;
+	gint32        *all_layers  = gimp_image_get_layers(image, &layer_count);
+	GeglBuffer   **buffers     = g_new0(GeglBuffer *, layer_count);
+	GeglRectangle *extents     = g_new0(GeglRectangle, layer_count);
+	gfloat        *opacities   = g_new0(gfloat, layer_count);
+	GeglRectangle  content     = { 0 };
+	gint           count       = 0;
+
+	for (gint i = layer_count - 1; i >= 0; --i) {
+		if (!gimp_item_get_visible(all_layers[i])) {
+			continue;
+		}
+
+		gint x, y;
+		gimp_drawable_offsets(all_layers[i], &x, &y);
+		gint x0 = round(x * scale);
+		gint y0 = round(y * scale);
+		gint x1 = round((x + gimp_drawable_width(all_layers[i])) * scale);
+		gint y1 = round((y + gimp_drawable_height(all_layers[i])) * scale);
+
+		buffers[count]   = gimp_drawable_get_buffer(all_layers[i]);
+		extents[count]   = (GeglRectangle) { x0, y0, x1 - x0, y1 - y0 };
+		opacities[count] = gimp_layer_get_opacity(all_layers[i]) / 100.0;
+
+		GeglRectangle covered;
+		if (buffers[count] && gegl_rectangle_intersect(&covered, &extents[count], &canvas)) {
+			gegl_rectangle_bounding_box(&content, &content, &covered);
+			++count;
+		} else if (buffers[count]) {
+			g_object_unref(buffers[count]);
+		}
+	}
+	g_free(all_layers);
+
+	result->width          = canvas.width;
+	result->height         = canvas.height;
+	result->content_x      = content.x;
+	result->content_y      = content.y;
+	result->content_width  = content.width;
+	result->content_height = content.height;
+
+	result->pixels = g_try_malloc((gsize) content.width * content.height * sizeof(*result->pixels));
+	bool success = result->pixels || content.width * content.height == 0;
+
+	const Babl *layer_format  = babl_format(is_legacy ? "R'aG'aB'aA float" : "RaGaBaA float");
+	const Babl *export_format = 0;
+	switch (options.colorspace) {
+		case QOI_COLORSPACE_SRGB: export_format = babl_format("R~G~B~A u8"); break;
+		case QOI_COLORSPACE_LINEAR: export_format = babl_format("RGBA u8"); break;
+		default: assert(!"Not reached!"); break;
+	}
+
+	const Babl *fish = babl_fish(layer_format, export_format);
+
+	gint  band_count = success ? (content.height + QOI_COMPOSITE_BAND_HEIGHT - 1) / QOI_COMPOSITE_BAND_HEIGHT : 0;
+	gsize band_size  = (gsize) content.width * QOI_COMPOSITE_BAND_HEIGHT * (count + 1) * 4 * sizeof(gfloat);
+	gint  in_flight  = MAX(1, (gint) MIN(QOI_COMPOSITE_MEMORY_LIMIT / MAX(band_size, 1), 2 * g_get_num_processors()));
+
+	QoiComposite composite;
+	g_mutex_init(&composite.mutex);
+	g_cond_init(&composite.done);
+
+	QoiCompositeJob   *jobs   = g_new0(QoiCompositeJob, band_count);
+	QoiCompositeLayer *layers = g_new0(QoiCompositeLayer, (gsize) band_count * count);
+	GThreadPool       *pool   = g_thread_pool_new(composite_band_worker, &composite, g_get_num_processors(), false, 0);
+
+	for (gint i = 0; i < band_count && success; ++i) {
+		if (i >= in_flight) {
+			g_mutex_lock(&composite.mutex);
+			while (!jobs[i - in_flight].done) {
+				g_cond_wait(&composite.done, &composite.mutex);
+			}
+			g_mutex_unlock(&composite.mutex);
+		}
+
+		QoiCompositeJob *job = &jobs[i];
+		job->result = result;
+		job->band   = (GeglRectangle) {
+			content.x, content.y + i * QOI_COMPOSITE_BAND_HEIGHT,
+			content.width, MIN(QOI_COMPOSITE_BAND_HEIGHT, content.height - i * QOI_COMPOSITE_BAND_HEIGHT),
+		};
+		job->layers = &layers[(gsize) i * count];
+		job->fish   = fish;
+
+		for (gint l = 0; l < count && success; ++l) {
+			GeglRectangle rect;
+			if (!gegl_rectangle_intersect(&rect, &job->band, &extents[l])) {
+				continue;
+			}
+
+			gfloat *samples = g_try_new(gfloat, (gsize) rect.width * rect.height * 4);
+			if (!samples) {
+				success = false;
+				continue;
+			}
+
+			// This procedure doesn't indicate if it fails, it just doesn't put any pixels in the image.
+			gegl_buffer_get(
+				buffers[l],
+				GEGL_RECTANGLE(rect.x - extents[l].x, rect.y - extents[l].y, rect.width, rect.height), scale,
+				layer_format, samples,
+				GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE
+			);
+
+			job->layers[job->layer_count++] = (QoiCompositeLayer) { rect, opacities[l], samples };
+		}
+
+		if (success) {
+			g_thread_pool_push(pool, job, 0);
+		} else {
+			for (gint l = 0; l < job->layer_count; ++l) {
+				g_free(job->layers[l].samples);
+			}
+		}
+		qoi_progress_update((gdouble) (i + 1) / (gdouble) band_count);
+	}
+
+	// Waits for all of the bands to be composited.
+	g_thread_pool_free(pool, false, true);
+
+	for (gint i = 0; i < band_count; ++i) {
+		success = success && jobs[i].success;
+	}
+
+	g_free(layers);
+	g_free(jobs);
+	for (gint l = 0; l < count; ++l) {
+		g_object_unref(buffers[l]);
+	}
+	g_free(opacities);
+	g_free(extents);
+	g_free(buffers);
+	g_cond_clear(&composite.done);
+	g_mutex_clear(&composite.mutex);
+
+	gimp_progress_end();
+
+	return success;
+}
+
+#define QOI_COPY_BUFFER_SIZE (64 * 1024)
+
+// Everything that goes into the encoded file, so images with the same digest
+// encode to the same data.
+static gchar *qoi_image_digest(QoiImage image) {
+	guint32 fields[] = {
+		image.width, image.height,
+		image.content_x, image.content_y, image.content_width, image.content_height,
+		image.colorspace, image.has_alpha, image.orientation, image.premultiply,
+	};
+
+	GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+	g_checksum_update(checksum, (const guchar *) fields, sizeof(fields));
+	g_checksum_update(checksum, (const guchar *) image.pixels, (gsize) image.content_width * image.content_height * sizeof(*image.pixels));
+	gchar *digest = g_strdup(g_checksum_get_string(checksum));
+	g_checksum_free(checksum);
+	return digest;
+}
+
+// Gives destination the contents of source, a file that has already been
+// exported. A hard link shares the file itself, so changing one changes the
+// other, and is only made when it is asked for. Otherwise the data is shared
+// with a reflink on file systems that support it, or copied.
+static bool duplicate_file(const gchar *source, const gchar *destination, bool allow_hard_link) {
+	if (strcmp(source, destination) == 0) {
+		return true;
+	}
+
+	// The link is made under a temporary name and renamed over destination,
+	// so an existing file is only replaced once the link is there. Renaming
+	// a link over another link to the same file does nothing, so that case is
+	// done before anything is made.
+	if (allow_hard_link) {
+		struct stat source_stat;
+		struct stat destination_stat;
+		if (
+			stat(source, &source_stat) == 0 && stat(destination, &destination_stat) == 0 &&
+			source_stat.st_dev == destination_stat.st_dev && source_stat.st_ino == destination_stat.st_ino
+		) {
+			return true;
+		}
+
+		gchar *link_filename = g_strdup_printf("%s.XXXXXX", destination);
+		gint   placeholder   = g_mkstemp(link_filename);
+		bool   is_linked     = false;
+		if (placeholder != -1) {
+			close(placeholder);
+			g_unlink(link_filename);
+			is_linked = link(source, link_filename) == 0;
+			if (is_linked && g_rename(link_filename, destination) != 0) {
+				g_unlink(link_filename);
+				is_linked = false;
+			}
+		}
+		g_free(link_filename);
+
+		if (is_linked) {
+			return true;
+		}
+	}
+
+	gint input = g_open(source, O_RDONLY, 0);
+	if (input == -1) {
+		return false;
+	}
+
+	gchar *temporary_filename = g_strdup_printf("%s.XXXXXX", destination);
+	gint   output             = g_mkstemp_full(temporary_filename, O_WRONLY, 0666);
+	bool   success            = output != -1;
+
+	bool is_cloned = false;
+#ifdef FICLONE
+	is_cloned = success && ioctl(output, FICLONE, input) == 0;
+#endif
+
+	if (success && !is_cloned) {
+		guint8 *buffer = g_malloc(QOI_COPY_BUFFER_SIZE);
+		gssize  size;
+		while ((size = read(input, buffer, QOI_COPY_BUFFER_SIZE)) > 0) {
+			if (write(output, buffer, size) != size) {
+				success = false;
+				break;
+			}
+		}
+		success = success && size == 0;
+		g_free(buffer);
+	}
+
+	if (output != -1) {
+		success = close(output) == 0 && success;
+		if (!success || g_rename(temporary_filename, destination) != 0) {
+			g_unlink(temporary_filename);
+			success = false;
+		}
+	}
+	close(input);
+	g_free(temporary_filename);
+
+	return success;
+}
+
+typedef struct {
+	QoiImage  image;
+	gchar    *filename;
+	guint64   reserved_bytes;
+	bool      verify;
+	bool      success;
+	bool      done;
+
+	// Follows the job from the thread fetching its pixels to the thread
+	// saving them, when tracing is enabled.
+	QoiTrace *trace;
+} QoiBatchJob;
+
+// Shared between the thread fetching pixels and the threads saving images.
+// Fetching waits until enough of the images that are being saved are done to
+// keep the pixels in memory below the limit.
+//
+// With deduplication, the first job with a digest is recorded in outputs.
+// Later jobs with the same digest wait for it to be done and duplicate its
+// file instead of encoding their own. Jobs are taken from the pool in the
+// order they were pushed, so the first job is always running by then.
+typedef struct {
+	GMutex        mutex;
+	GCond         done;
+	guint64       bytes_in_flight;
+	QoiDedupMode  dedup;
+	GHashTable   *outputs;
+} QoiBatch;
+
+static void batch_export_worker(gpointer data, gpointer user_data) {
+	QoiBatchJob *job      = data;
+	QoiBatch    *batch    = user_data;
+	QoiBatchJob *original = 0;
+
+	if (batch->dedup != QOI_DEDUP_NONE) {
+		gchar *digest = qoi_image_digest(job->image);
+
+		g_mutex_lock(&batch->mutex);
+		original = g_hash_table_lookup(batch->outputs, digest);
+		if (original) {
+			while (!original->done) {
+				g_cond_wait(&batch->done, &batch->mutex);
+			}
+			g_free(digest);
+		} else {
+			g_hash_table_insert(batch->outputs, digest, job);
+		}
+		g_mutex_unlock(&batch->mutex);
+	}
+
+	qoi_trace_activate(job->trace);
+
+	// A duplicate of an export that failed is encoded after all.
+	qoi_trace_enter(QOI_PHASE_IO);
+	job->success = (
+		original && original->success &&
+		duplicate_file(original->filename, job->filename, batch->dedup == QOI_DEDUP_HARD_LINK)
+	);
+	if (!job->success) {
+		qoi_trace_enter(QOI_PHASE_ENCODE);
+		job->success = save_image(job->image, job->filename, false, job->verify);
+	}
+
+	if (job->trace) {
+		qoi_trace_finish(job->trace, "batch-save", job->filename, job->image.width, job->image.height, job->success);
+		qoi_trace_activate(0);
+	}
+
+	g_free(job->image.pixels);
+	job->image.pixels = 0;
+
+	g_mutex_lock(&batch->mutex);
+	batch->bytes_in_flight -= job->reserved_bytes;
+	job->done = true;
+	g_cond_broadcast(&batch->done);
+	g_mutex_unlock(&batch->mutex);
+}
+
+// Pixels have to be fetched from the main thread, as that is where the
+// connection to GIMP lives, but encoding and writing the files is done on a
+// pool of threads while the next drawable is fetched. An image larger than
+// the memory limit is still exported, but only once nothing else is in
+// flight.
+static bool batch_export(const gint32 *drawables, gchar **filenames, gint count, QoiExportOptions options, guint64 memory_limit, QoiDedupMode dedup) {
+	QoiBatch batch = { 0 };
+	g_mutex_init(&batch.mutex);
+	g_cond_init(&batch.done);
+	batch.dedup   = dedup;
+	batch.outputs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, 0);
+
+	QoiBatchJob *jobs   = g_new0(QoiBatchJob, count);
+	QoiTrace    *traces = qoi_trace_is_enabled() ? g_new0(QoiTrace, count) : 0;
+	GThreadPool *pool   = g_thread_pool_new(batch_export_worker, &batch, g_get_num_processors(), false, 0);
+
+	for (gint i = 0; i < count; ++i) {
+		gint32  drawable = drawables[i];
+		guint64 size     = (guint64) gimp_drawable_width(drawable) * gimp_drawable_height(drawable) * sizeof(QoiPixel);
+
+		g_mutex_lock(&batch.mutex);
+		while (batch.bytes_in_flight != 0 && batch.bytes_in_flight + size > memory_limit) {
+			g_cond_wait(&batch.done, &batch.mutex);
+		}
+		batch.bytes_in_flight += size;
+		g_mutex_unlock(&batch.mutex);
+
+		jobs[i].filename       = filenames[i];
+		jobs[i].reserved_bytes = size;
+		jobs[i].verify         = options.verify;
+
+		if (traces) {
+			jobs[i].trace = &traces[i];
+			qoi_trace_begin(jobs[i].trace);
+			qoi_trace_activate(jobs[i].trace);
+			qoi_trace_enter(QOI_PHASE_TRANSFER);
+		}
+		bool is_fetched = get_qoi_image_from_gimp(gimp_item_get_image(drawable), drawable, options, &jobs[i].image);
+		qoi_trace_enter(QOI_PHASE_OTHER);
+		qoi_trace_activate(0);
+
+		if (is_fetched) {
+			g_thread_pool_push(pool, &jobs[i], 0);
+		} else {
+			g_free(jobs[i].image.pixels);
+			g_mutex_lock(&batch.mutex);
+			batch.bytes_in_flight -= size;
+			g_mutex_unlock(&batch.mutex);
+		}
+	}
+
+	// Waits for all of the images to be saved.
+	g_thread_pool_free(pool, false, true);
+
+	bool success = true;
+	for (gint i = 0; i < count; ++i) {
+		if (!jobs[i].success) {
+			g_message("Could not export '%s'.", filenames[i]);
+			success = false;
+		}
+	}
+
+	g_free(traces);
+	g_free(jobs);
+	g_hash_table_destroy(batch.outputs);
+	g_cond_clear(&batch.done);
+	g_mutex_clear(&batch.mutex);
+
+	return success;
+}
+
+// Synthetic images mix the kinds of content that take different paths
+// through the encoder and decoder: a transparent margin and flat areas that
+// become runs, gradients that become small differences and noise that needs
+// whole pixels. They are the same on every machine, so timings from different
+// machines can be compared.
+static bool generate_benchmark_image(guint32 width, guint32 height, QoiImage *result) {
+	*result = (QoiImage) {
+		.width          = width,
+		.height         = height,
+		.content_width  = width,
+		.content_height = height,
+		.colorspace     = QOI_COLORSPACE_SRGB,
+		.has_alpha      = true,
+	};
+
+	result->pixels = g_try_malloc((gsize) width * height * sizeof(*result->pixels));
+	if (!result->pixels) {
+		return false;
+	}
+
+	static const QoiPixel flat_colors[] = {
+		{ 230,  57,  70, 255 },
+		{ 241, 250, 238, 255 },
+		{ 168, 218, 220, 255 },
+		{  29,  53,  87, 255 },
+	};
+
+	guint32 seed = 1;
+	for (guint32 y = 0; y < height; ++y) {
+		for (guint32 x = 0; x < width; ++x) {
+			QoiPixel pixel = { 0 };
+			if (x < width / 16 || y < height / 16) {
+				pixel = (QoiPixel) { 0 };
+			} else if (y < height / 3) {
+				pixel = (QoiPixel) { x * 255 / width, y * 255 / height, (x + y) / 4, 255 };
+			} else if (y < height * 2 / 3) {
+				pixel = flat_colors[(x / 64 + y / 64) % G_N_ELEMENTS(flat_colors)];
+			} else {
+				seed = seed * 1664525 + 1013904223;
+				pixel = (QoiPixel) { seed >> 24, seed >> 16, seed >> 8, 255 };
+			}
+			result->pixels[(gsize) y * width + x] = pixel;
+		}
+	}
+
+	return true;
+}
+
+// The baselines write the same rows that a QOI file would hold, without
+// alpha when the image has none. Images whose content covers the canvas are
+// the only ones the benchmark creates, but the margins are filled in anyway.
+static QoiPixel *baseline_canvas(QoiImage image) {
+	QoiImage  file   = qoi_image_oriented(image);
+	QoiPixel *canvas = g_try_new(QoiPixel, (gsize) file.width * file.height);
+	if (!canvas) {
+		return 0;
+	}
+
+	for (guint32 y = 0; y < file.height; ++y) {
+		qoi_image_file_row(image, y, &canvas[(gsize) y * file.width]);
+	}
+	return canvas;
+}
+
+// Packs pixels into 3 bytes each, in place.
+static void baseline_pack_rgb(QoiPixel *pixels, gsize count) {
+	guint8 *samples = (guint8 *) pixels;
+	for (gsize i = 0; i < count; ++i) {
+		QoiPixel pixel = pixels[i];
+		samples[i * 3 + 0] = pixel.red;
+		samples[i * 3 + 1] = pixel.green;
+		samples[i * 3 + 2] = pixel.blue;
+	}
+}
+
+// Expands pixels from 3 bytes each, in place.
+static void baseline_unpack_rgb(QoiPixel *pixels, gsize count) {
+	const guint8 *samples = (const guint8 *) pixels;
+	for (gsize i = count; i-- > 0;) {
+		pixels[i] = (QoiPixel) { samples[i * 3 + 0], samples[i * 3 + 1], samples[i * 3 + 2], 255 };
+	}
+}
+
+static bool baseline_write_file(const gchar *path, const void *data, gsize size) {
+	QoiPhase previous = qoi_trace_enter(QOI_PHASE_IO);
+	FILE    *fd       = fopen(path, "wb");
+	bool     success  = fd && fwrite(data, 1, size, fd) == size;
+	if (fd && fclose(fd) != 0) {
+		success = false;
+	}
+	qoi_trace_enter(previous);
+	return success;
+}
+
+// Raw samples with a short text header, written and read a row at a time, as
+// the lower bound of what any format costs.
+static bool save_pam(QoiImage image, const gchar *path) {
+	QoiImage  file = qoi_image_oriented(image);
+	QoiPixel *row  = g_try_new(QoiPixel, file.width);
+	if (!row) {
+		return false;
+	}
+
+	QoiPhase previous = qoi_trace_enter(QOI_PHASE_IO);
+	FILE    *fd       = fopen(path, "wb");
+	qoi_trace_enter(previous);
+	if (!fd) {
+		g_free(row);
+		return false;
+	}
+
+	guint depth   = image.has_alpha ? 4 : 3;
+	bool  success = fprintf(
+		fd, "P7\nWIDTH %u\nHEIGHT %u\nDEPTH %u\nMAXVAL 255\nTUPLTYPE %s\nENDHDR\n",
+		file.width, file.height, depth, image.has_alpha ? "RGB_ALPHA" : "RGB"
+	) > 0;
+	for (guint32 y = 0; y < file.height && success; ++y) {
+		qoi_image_file_row(image, y, row);
+		if (!image.has_alpha) {
+			baseline_pack_rgb(row, file.width);
+		}
+
+		previous = qoi_trace_enter(QOI_PHASE_IO);
+		success  = fwrite(row, depth, file.width, fd) == file.width;
+		qoi_trace_enter(previous);
+	}
+
+	previous = qoi_trace_enter(QOI_PHASE_IO);
+	if (fclose(fd) != 0) {
+		success = false;
+	}
+	qoi_trace_enter(previous);
+
+	g_free(row);
+	return success;
+}
+
+static bool load_pam(const gchar *path, QoiImage *result) {
+	QoiPhase previous = qoi_trace_enter(QOI_PHASE_IO);
+	FILE    *fd       = fopen(path, "rb");
+	qoi_trace_enter(previous);
+	if (!fd) {
+		return false;
+	}
+
+	guint32 width  = 0;
+	guint32 height = 0;
+	guint   depth  = 0;
+	guint   maxval = 0;
+	gchar   line[128];
+	bool    has_header = fgets(line, sizeof(line), fd) && strcmp(line, "P7\n") == 0;
+	while (has_header && fgets(line, sizeof(line), fd) && strcmp(line, "ENDHDR\n") != 0) {
+		sscanf(line, "WIDTH %u", &width);
+		sscanf(line, "HEIGHT %u", &height);
+		sscanf(line, "DEPTH %u", &depth);
+		sscanf(line, "MAXVAL %u", &maxval);
+	}
+
+	if (!has_header || width == 0 || height == 0 || (depth != 3 && depth != 4) || maxval != 255) {
+		fclose(fd);
+		return false;
+	}
+
+	QoiPixel *pixels = g_try_new(QoiPixel, (gsize) width * height);
+	if (!pixels) {
+		fclose(fd);
+		return false;
+	}
+
+	bool success = true;
+	for (guint32 y = 0; y < height && success; ++y) {
+		QoiPixel *row = &pixels[(gsize) y * width];
+
+		previous = qoi_trace_enter(QOI_PHASE_IO);
+		success  = fread(row, depth, width, fd) == width;
+		qoi_trace_enter(previous);
+
+		if (depth == 3) {
+			baseline_unpack_rgb(row, width);
+		}
+	}
+	fclose(fd);
+
+	if (!success) {
+		g_free(pixels);
+		return false;
+	}
+
+	*result = (QoiImage) {
+		.pixels         = pixels,
+		.width          = width,
+		.height         = height,
+		.content_width  = width,
+		.content_height = height,
+		.colorspace     = QOI_COLORSPACE_SRGB,
+		.has_alpha      = depth == 4,
+	};
+	return true;
+}
+
+#ifdef HAVE_LIBPNG
+// libpng writes with its default compression level, like most programs that
+// use it.
+static bool save_png(QoiImage image, const gchar *path) {
+	QoiImage  file   = qoi_image_oriented(image);
+	QoiPixel *canvas = baseline_canvas(image);
+	if (!canvas) {
+		return false;
+	}
+	if (!image.has_alpha) {
+		baseline_pack_rgb(canvas, (gsize) file.width * file.height);
+	}
+
+	png_image png = { 0 };
+	png.version   = PNG_IMAGE_VERSION;
+	png.width     = file.width;
+	png.height    = file.height;
+	png.format    = image.has_alpha ? PNG_FORMAT_RGBA : PNG_FORMAT_RGB;
+
+	// The first call only computes the size of the file, the second one
+	// encodes into memory so that writing the file is counted as I/O.
+	png_alloc_size_t size    = 0;
+	void            *data    = 0;
+	bool             success = png_image_write_to_memory(&png, 0, &size, 0, canvas, 0, 0) != 0
+		&& (data = g_try_malloc(size)) != 0
+		&& png_image_write_to_memory(&png, data, &size, 0, canvas, 0, 0) != 0;
+	png_image_free(&png);
+	g_free(canvas);
+
+	success = success && baseline_write_file(path, data, size);
+	g_free(data);
+	return success;
+}
+
+static bool load_png(const gchar *path, QoiImage *result) {
+	gchar *data = 0;
+	gsize  size = 0;
+
+	QoiPhase previous = qoi_trace_enter(QOI_PHASE_IO);
+	bool     is_read  = g_file_get_contents(path, &data, &size, 0);
+	qoi_trace_enter(previous);
+	if (!is_read) {
+		return false;
+	}
+
+	png_image png = { 0 };
+	png.version   = PNG_IMAGE_VERSION;
+	if (!png_image_begin_read_from_memory(&png, data, size)) {
+		g_free(data);
+		return false;
+	}
+
+	bool has_alpha = (png.format & PNG_FORMAT_FLAG_ALPHA) != 0;
+	png.format = PNG_FORMAT_RGBA;
+
+	QoiPixel *pixels = g_try_new(QoiPixel, (gsize) png.width * png.height);
+	bool success = pixels && png_image_finish_read(&png, 0, pixels, 0, 0);
+	png_image_free(&png);
+	g_free(data);
+	if (!success) {
+		g_free(pixels);
+		return false;
+	}
+
+	*result = (QoiImage) {
+		.pixels         = pixels,
+		.width          = png.width,
+		.height         = png.height,
+		.content_width  = png.width,
+		.content_height = png.height,
+		.colorspace     = QOI_COLORSPACE_SRGB,
+		.has_alpha      = has_alpha,
+	};
+	return true;
+}
+#endif
+
+#ifdef HAVE_LIBWEBP
+// Lossless WebP with the default settings of the simple encoding API.
+static bool save_webp(QoiImage image, const gchar *path) {
+	QoiImage  file   = qoi_image_oriented(image);
+	QoiPixel *canvas = baseline_canvas(image);
+	if (!canvas) {
+		return false;
+	}
+
+	uint8_t *data = 0;
+	size_t   size = 0;
+	if (image.has_alpha) {
+		size = WebPEncodeLosslessRGBA((const uint8_t *) canvas, file.width, file.height, file.width * 4, &data);
+	} else {
+		baseline_pack_rgb(canvas, (gsize) file.width * file.height);
+		size = WebPEncodeLosslessRGB((const uint8_t *) canvas, file.width, file.height, file.width * 3, &data);
+	}
+	g_free(canvas);
+
+	bool success = size != 0 && baseline_write_file(path, data, size);
+	WebPFree(data);
+	return success;
+}
+
+static bool load_webp(const gchar *path, QoiImage *result) {
+	gchar *data = 0;
+	gsize  size = 0;
+
+	QoiPhase previous = qoi_trace_enter(QOI_PHASE_IO);
+	bool     is_read  = g_file_get_contents(path, &data, &size, 0);
+	qoi_trace_enter(previous);
+	if (!is_read) {
+		return false;
+	}
+
+	WebPBitstreamFeatures features;
+	if (WebPGetFeatures((const uint8_t *) data, size, &features) != VP8_STATUS_OK) {
+		g_free(data);
+		return false;
+	}
+
+	gsize     pixel_count = (gsize) features.width * features.height;
+	QoiPixel *pixels      = g_try_new(QoiPixel, pixel_count);
+	bool      success     = pixels && WebPDecodeRGBAInto(
+		(const uint8_t *) data, size,
+		(uint8_t *) pixels, pixel_count * sizeof(*pixels), features.width * sizeof(*pixels)
+	);
+	g_free(data);
+	if (!success) {
+		g_free(pixels);
+		return false;
+	}
+
+	*result = (QoiImage) {
+		.pixels         = pixels,
+		.width          = features.width,
+		.height         = features.height,
+		.content_width  = features.width,
+		.content_height = features.height,
+		.colorspace     = QOI_COLORSPACE_SRGB,
+		.has_alpha      = features.has_alpha,
+	};
+	return true;
+}
+#endif
+
+// Every case goes through the same functions as the procedures do. The save
+// cases export the image that was created from the synthetic pixels to the
+// file at path, the load cases load that file into a new image. The PNG,
+// WebP and PAM cases are baselines that only swap out the encoder and
+// decoder, the pixels go to and from GIMP the same way.
+typedef enum {
+	BENCHMARK_SAVE = 0,
+	BENCHMARK_SAVE_VERIFIED,
+	BENCHMARK_LOAD,
+	BENCHMARK_LOAD_FLOAT,
+	BENCHMARK_SAVE_PNG,
+	BENCHMARK_LOAD_PNG,
+	BENCHMARK_SAVE_WEBP,
+	BENCHMARK_LOAD_WEBP,
+	BENCHMARK_SAVE_PAM,
+	BENCHMARK_LOAD_PAM,
+	BENCHMARK_SAVE_COMPOSITED,
+	BENCHMARK_CASE_COUNT,
+} QoiBenchmarkCase;
+
+static const gchar *const BENCHMARK_CASE_NAMES[BENCHMARK_CASE_COUNT] = {
+	[BENCHMARK_SAVE]            = "benchmark-save",
+	[BENCHMARK_SAVE_VERIFIED]   = "benchmark-save-verified",
+	[BENCHMARK_LOAD]            = "benchmark-load",
+	[BENCHMARK_LOAD_FLOAT]      = "benchmark-load-float",
+	[BENCHMARK_SAVE_PNG]        = "benchmark-save-png",
+	[BENCHMARK_LOAD_PNG]        = "benchmark-load-png",
+	[BENCHMARK_SAVE_WEBP]       = "benchmark-save-webp",
+	[BENCHMARK_LOAD_WEBP]       = "benchmark-load-webp",
+	[BENCHMARK_SAVE_PAM]        = "benchmark-save-pam",
+	[BENCHMARK_LOAD_PAM]        = "benchmark-load-pam",
+	[BENCHMARK_SAVE_COMPOSITED] = "benchmark-save-composited",
+};
+
+// Baselines whose library the plug-in was built without are skipped.
+static bool benchmark_case_is_available(QoiBenchmarkCase benchmark_case) {
+	switch (benchmark_case) {
+#ifndef HAVE_LIBPNG
+		case BENCHMARK_SAVE_PNG:
+		case BENCHMARK_LOAD_PNG: return false;
+#endif
+#ifndef HAVE_LIBWEBP
+		case BENCHMARK_SAVE_WEBP:
+		case BENCHMARK_LOAD_WEBP: return false;
+#endif
+		default: return true;
+	}
+}
+
+static bool save_baseline(QoiBenchmarkCase benchmark_case, QoiImage image, const gchar *path) {
+	switch (benchmark_case) {
+#ifdef HAVE_LIBPNG
+		case BENCHMARK_SAVE_PNG: return save_png(image, path);
+#endif
+#ifdef HAVE_LIBWEBP
+		case BENCHMARK_SAVE_WEBP: return save_webp(image, path);
+#endif
+		case BENCHMARK_SAVE_PAM: return save_pam(image, path);
+		default: return false;
+	}
+}
+
+static bool load_baseline(QoiBenchmarkCase benchmark_case, const gchar *path, QoiImage *result) {
+	switch (benchmark_case) {
+#ifdef HAVE_LIBPNG
+		case BENCHMARK_LOAD_PNG: return load_png(path, result);
+#endif
+#ifdef HAVE_LIBWEBP
+		case BENCHMARK_LOAD_WEBP: return load_webp(path, result);
+#endif
+		case BENCHMARK_LOAD_PAM: return load_pam(path, result);
+		default: return false;
+	}
+}
+
+static bool benchmark_run(QoiBenchmarkCase benchmark_case, gint32 image, gint32 drawable, const gchar *path, const QoiCounters *counters, QoiTrace *trace) {
+	QoiExportOptions options = {
+		.colorspace   = QOI_COLORSPACE_SRGB,
+		.export_alpha = true,
+		.verify       = benchmark_case == BENCHMARK_SAVE_VERIFIED,
+		.canvas_size  = true,
+	};
+
+	QoiImage qoi_image = { 0 };
+	gint32   loaded    = -1;
+	bool     success   = false;
+
+	qoi_trace_begin(trace);
+	if (counters) {
+		qoi_trace_count(trace, counters);
+	}
+	qoi_trace_activate(trace);
+
+	switch (benchmark_case) {
+		case BENCHMARK_SAVE:
+		case BENCHMARK_SAVE_VERIFIED:
+		case BENCHMARK_SAVE_COMPOSITED: {
+			bool is_legacy = false;
+
+			qoi_trace_enter(QOI_PHASE_TRANSFER);
+			bool is_fetched = benchmark_case == BENCHMARK_SAVE_COMPOSITED ?
+				can_composite_layers(image, &is_legacy) && get_qoi_image_from_layers(image, options, is_legacy, &qoi_image) :
+				get_qoi_image_from_gimp(image, drawable, options, &qoi_image);
+
+			qoi_trace_enter(QOI_PHASE_ENCODE);
+			success = is_fetched && save_image(qoi_image, path, true, options.verify);
+		} break;
+		case BENCHMARK_LOAD:
+		case BENCHMARK_LOAD_FLOAT: {
+			QoiLoadOptions load_options = {
+				.precision = benchmark_case == BENCHMARK_LOAD_FLOAT ? QOI_LOAD_PRECISION_FLOAT_LINEAR : QOI_LOAD_PRECISION_U8,
+			};
+			QoiDecodeStats stats;
+
+			qoi_trace_enter(QOI_PHASE_DECODE);
+			if (load_image(path, &qoi_image, &stats)) {
+				qoi_trace_enter(QOI_PHASE_TRANSFER);
+				GeglRectangle crop = { 0, 0, qoi_image.width, qoi_image.height };
+				loaded  = create_gimp_image_from_qoi_image(qoi_image, crop, GIMP_RGB, load_options, &stats, path);
+				success = loaded != -1;
+			}
+		} break;
+		case BENCHMARK_SAVE_PNG:
+		case BENCHMARK_SAVE_WEBP:
+		case BENCHMARK_SAVE_PAM: {
+			qoi_trace_enter(QOI_PHASE_TRANSFER);
+			bool is_fetched = get_qoi_image_from_gimp(image, drawable, options, &qoi_image);
+
+			qoi_trace_enter(QOI_PHASE_ENCODE);
+			success = is_fetched && save_baseline(benchmark_case, qoi_image, path);
+		} break;
+		case BENCHMARK_LOAD_PNG:
+		case BENCHMARK_LOAD_WEBP:
+		case BENCHMARK_LOAD_PAM: {
+			qoi_trace_enter(QOI_PHASE_DECODE);
+			if (load_baseline(benchmark_case, path, &qoi_image)) {
+				qoi_trace_enter(QOI_PHASE_TRANSFER);
+				GeglRectangle crop = { 0, 0, qoi_image.width, qoi_image.height };
+				loaded  = create_gimp_image_from_qoi_image(qoi_image, crop, GIMP_RGB, (QoiLoadOptions) { 0 }, 0, path);
+				success = loaded != -1;
+			}
+		} break;
+		default: assert(!"Not reached!"); break;
+	}
+
+	qoi_trace_end(trace);
+	qoi_trace_activate(0);
+
+	if (loaded != -1) {
+		gimp_image_delete(loaded);
+	}
+	g_free(qoi_image.pixels);
+
+	return success;
+}
+
+static gint benchmark_trace_compare(gconstpointer a, gconstpointer b) {
+	gint64 total_a = qoi_trace_total(a);
+	gint64 total_b = qoi_trace_total(b);
+	return (total_a > total_b) - (total_a < total_b);
+}
+
+// Runs every case repeats times for images of a few sizes up to max_size.
+// Returns one line of JSON per run, in the same format as the trace lines so
+// scripts/trace_report.py can summarize them, or 0 when the benchmark could
+// not run at all. A case that fails, such as when a baseline library reports
+// an error or the temporary directory is full, stops after the line of its
+// failed run and the other cases still run. A summary with the median run of
+// every case is shown as a message when show_summary is set.
+//
+// With count_events, the lines also hold the CPU events of each phase on the
+// thread running the benchmark. Work that is handed to other threads, like
+// verifying and converting bands, is only counted as time.
+static gchar *benchmark(guint32 max_size, guint32 repeats, bool count_events, bool show_summary) {
+	static const guint32 sizes[] = { 256, 1024 };
+
+	gchar *path = 0;
+	gint   fd   = g_file_open_tmp("gimp-file-qoi-XXXXXX.qoi", &path, 0);
+	if (fd == -1) {
+		return 0;
+	}
+	close(fd);
+
+	GString  *lines   = g_string_new(0);
+	GString  *summary = g_string_new("QOI benchmark, median of each case:\n");
+	QoiTrace *traces  = g_new0(QoiTrace, repeats);
+
+	QoiCounters counters;
+	qoi_counters_init(&counters);
+	if (count_events) {
+		qoi_counters_open(&counters);
+	}
+	if (count_events && counters.count == 0) {
+		g_string_append(summary, "(CPU events are not available, check perf_event_paranoid)\n");
+	}
+
+	for (guint s = 0; s <= G_N_ELEMENTS(sizes); ++s) {
+		// Every size below max_size, followed by max_size itself.
+		guint32 width = s < G_N_ELEMENTS(sizes) ? sizes[s] : max_size;
+		if (s < G_N_ELEMENTS(sizes) && width >= max_size) {
+			continue;
+		}
+		guint32 height = MAX(1, width * 3 / 4);
+
+		gchar   *name = g_strdup_printf("synthetic-%ux%u", width, height);
+		QoiImage source;
+		if (!generate_benchmark_image(width, height, &source)) {
+			g_string_append_printf(summary, "%s: failed, the image could not be created\n", name);
+			g_free(name);
+			continue;
+		}
+
+		GeglRectangle crop = { 0, 0, width, height };
+		gint32 image = create_gimp_image_from_qoi_image(source, crop, GIMP_RGB, (QoiLoadOptions) { 0 }, 0, name);
+		g_free(source.pixels);
+		if (image == -1) {
+			g_string_append_printf(summary, "%s: failed, the image could not be created\n", name);
+			g_free(name);
+			continue;
+		}
+		gint32 drawable = gimp_image_get_active_drawable(image);
+
+		for (gint c = 0; c < BENCHMARK_CASE_COUNT; ++c) {
+			if (!benchmark_case_is_available(c)) {
+				continue;
+			}
+
+			// Composited saves need layers to composite, half transparent
+			// copies of the first are stacked on top of it.
+			if (c == BENCHMARK_SAVE_COMPOSITED) {
+				for (gint copies = 0; copies < 2; ++copies) {
+					gint32 copy = gimp_layer_copy(drawable);
+					gimp_image_insert_layer(image, copy, 0, 0);
+					gimp_layer_set_opacity(copy, 50.0);
+				}
+
+				// Saving through the export path instead would measure
+				// something else under the same name.
+				if (!can_composite_layers(image, 0)) {
+					g_string_append_printf(summary, "%s %s: skipped, the layers can't be composited\n", BENCHMARK_CASE_NAMES[c], name);
+					continue;
+				}
+			}
+
+			guint64 bytes   = 0;
+			bool    success = true;
+			for (guint32 r = 0; r < repeats && success; ++r) {
+				success = benchmark_run(c, image, drawable, path, count_events ? &counters : 0, &traces[r]);
+
+				struct stat file_stat;
+				bytes = stat(path, &file_stat) == 0 ? (guint64) file_stat.st_size : 0;
+				qoi_trace_append_json(lines, &traces[r], BENCHMARK_CASE_NAMES[c], name, width, height, bytes, success);
+			}
+
+			if (!success) {
+				g_string_append_printf(summary, "%s %s: failed\n", BENCHMARK_CASE_NAMES[c], name);
+			} else {
+				qsort(traces, repeats, sizeof(*traces), benchmark_trace_compare);
+				QoiTrace *median = &traces[repeats / 2];
+				g_string_append_printf(
+					summary, "%s %s: %.1f ms (%.1f MP/s, %.1f KiB file)",
+					BENCHMARK_CASE_NAMES[c], name,
+					qoi_trace_total(median) / 1000.0,
+					(gdouble) width * height / MAX(qoi_trace_total(median), 1),
+					bytes / 1024.0
+				);
+				for (gint phase = 0; phase < QOI_PHASE_COUNT; ++phase) {
+					if (median->phases[phase] != 0) {
+						g_string_append_printf(summary, ", %s %.1f ms", QOI_PHASE_NAMES[phase], median->phases[phase] / 1000.0);
+					}
+				}
+				if (median->counters && qoi_counters_is_open(median->counters, QOI_COUNTER_CYCLES)) {
+					guint64 cycles       = 0;
+					guint64 instructions = 0;
+					for (gint phase = 0; phase < QOI_PHASE_COUNT; ++phase) {
+						cycles       += median->phase_counters[phase][QOI_COUNTER_CYCLES];
+						instructions += median->phase_counters[phase][QOI_COUNTER_INSTRUCTIONS];
+					}
+					g_string_append_printf(summary, ", %.1f cycles per pixel", (gdouble) cycles / ((gdouble) width * height));
+					if (qoi_counters_is_open(median->counters, QOI_COUNTER_INSTRUCTIONS) && cycles != 0) {
+						g_string_append_printf(summary, ", %.2f instructions per cycle", (gdouble) instructions / cycles);
+					}
+				}
+				g_string_append_c(summary, '\n');
+			}
+		}
+
+		gimp_image_delete(image);
+		g_free(name);
+	}
+
+	qoi_counters_close(&counters);
+	g_unlink(path);
+	g_free(path);
+	g_free(traces);
+
+	if (show_summary) {
+		g_message("%s", summary->str);
+	}
+	g_string_free(summary, true);
+
+	return g_string_free(lines, lines->len == 0);
+}
+
+#define QOI_WATCH_BAND_HEIGHT 16
+
+// Where decoding a band of rows of a watched file starts: the position in
+// the file and the state of the decoder at that position.
+typedef struct {
+	gsize      data_index;
+	QoiDecoder decoder;
+} QoiCheckpoint;
+
+// Identifies a version of a file. Tools that replace a file instead of
+// writing to it change the inode, so it is part of the stamp.
+typedef struct {
+	gint64  size;
+	gint64  modified_seconds;
+	gint64  modified_nanoseconds;
+	guint64 inode;
+} QoiFileStamp;
+
+static bool qoi_file_stamp(const gchar *filename, QoiFileStamp *stamp) {
+	struct stat file_stat;
+	if (stat(filename, &file_stat) != 0) {
+		return false;
+	}
+
+	*stamp = (QoiFileStamp) {
+		.size                 = file_stat.st_size,
+		.modified_seconds     = file_stat.st_mtim.tv_sec,
+		.modified_nanoseconds = file_stat.st_mtim.tv_nsec,
+		.inode                = file_stat.st_ino,
+	};
+	return true;
+}
+
+// A file that is watched for changes, along with the data it held when it
+// was last read, the pixels decoded from that data and a checkpoint for every
+// band of rows. The layer is expected to hold the same pixels.
+typedef struct {
+	gint32         image;
+	gint32         layer;
+	gchar         *filename;
+	gchar         *data;
+	gsize          size;
+	QoiImage       qoi_image;
+	QoiCheckpoint *checkpoints;
+
+	// A change is only read once the stamp has stayed the same for a whole
+	// interval, so files that are still being written aren't read halfway.
+	QoiFileStamp   stamp;
+	bool           is_changing;
+	GMainLoop     *loop;
+	guint          poll_source;
+	guint          stop_source;
+} QoiWatch;
+
+static guint32 qoi_watch_band_count(QoiImage image) {
+	return (image.height + QOI_WATCH_BAND_HEIGHT - 1) / QOI_WATCH_BAND_HEIGHT;
+}
+
+// Reads the header of a complete file in memory. The file has to end in the
+// end marker, which also keeps the decoder from reading past its end.
+static bool qoi_watch_parse_header(const gchar *data, gsize size, QoiImage *image) {
+	if (size < QOI_HEADER_SIZE + QOI_END_MARKER_SIZE) {
+		return false;
+	}
+
+	QoiHeader header;
+	memcpy(&header, data, QOI_HEADER_SIZE);
+
+	*image = (QoiImage) {
+		.width      = guint32_swap_local_and_big_endian(header.width),
+		.height     = guint32_swap_local_and_big_endian(header.height),
+		.colorspace = header.colorspace,
+		.has_alpha  = header.channels == QOI_CHANNELS_RGBA,
+	};
+	image->content_width  = image->width;
+	image->content_height = image->height;
+
+	return (
+		memcmp(header.magic, "qoif", 4) == 0 &&
+		(header.channels == QOI_CHANNELS_RGB || header.channels == QOI_CHANNELS_RGBA) &&
+		header.colorspace < QOI_COLORSPACE_COUNT &&
+		image->width != 0 && image->width <= GIMP_MAX_IMAGE_SIZE &&
+		image->height != 0 && image->height <= GIMP_MAX_IMAGE_SIZE &&
+		memcmp(&data[size - QOI_END_MARKER_SIZE], QOI_END_MARKER, QOI_END_MARKER_SIZE) == 0
+	);
+}
+
+// Decodes every band from first_band on into pixels, which starts at the
+// first row of first_band, and records the checkpoints of those bands.
+// Decoding starts from the checkpoint of first_band, which has to be valid
+// for data.
+static bool qoi_watch_decode(const gchar *data, gsize size, QoiImage image, guint32 first_band, QoiCheckpoint *checkpoints, QoiPixel *pixels) {
+	QoiDecoder decoder     = checkpoints[first_band].decoder;
+	gsize      position    = checkpoints[first_band].data_index;
+	gsize      pixel_index = 0;
+
+	for (guint32 band = first_band; band < qoi_watch_band_count(image); ++band) {
+		checkpoints[band] = (QoiCheckpoint) { position, decoder };
 
-	gimp_get_data(SAVE_PROC, options);
+		gsize band_size = (gsize) MIN(QOI_WATCH_BAND_HEIGHT, image.height - band * QOI_WATCH_BAND_HEIGHT) * image.width;
+		gsize written   = 0;
+		while (written < band_size) {
+			gsize decoded = qoi_decoder_decode(
+				&decoder,
+				(const guint8 *) data, size, &position,
+				&pixels[pixel_index + written], band_size - written
+			);
+			if (decoded == 0) {
+				return false;
+			}
+			written += decoded;
+		}
+		pixel_index += band_size;
+	}
 
-	gimp_ui_init("file-qoi", 0);
+	return decoder.run == 0 && position + QOI_END_MARKER_SIZE == size;
+}
 
-	export = gimp_export_image(image, drawable, "QOI", GIMP_EXPORT_CAN_HANDLE_RGB | GIMP_EXPORT_CAN_HANDLE_ALPHA);
+// Sends rows first_row up to last_row of an image of the given width to the
+// part of the layer that covers them.
+static void qoi_watch_transfer_rows(QoiWatch *watch, GeglBuffer *buffer, const Babl *format, guint32 width, guint32 first_row, guint32 last_row, const QoiPixel *pixels) {
+	GeglRectangle layer;
+	gimp_drawable_offsets(watch->layer, &layer.x, &layer.y);
+	layer.width  = gimp_drawable_width(watch->layer);
+	layer.height = gimp_drawable_height(watch->layer);
 
-	GtkWidget *dialog = gimp_export_dialog_new("QOI", "export", 0);
-	gtk_window_set_resizable(GTK_WINDOW(dialog), false);
+	GeglRectangle rows = { 0, first_row, width, last_row - first_row };
+	GeglRectangle area;
+	if (!gegl_rectangle_intersect(&area, &rows, &layer)) {
+		return;
+	}
 
-	GtkWidget *vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 12);
-	gtk_container_set_border_width(GTK_CONTAINER(vbox), 12);
-	gtk_box_pack_start(GTK_BOX(gimp_export_dialog_get_content_area(dialog)), vbox, true, true, 0);
-	gtk_widget_show(vbox);
+	gegl_buffer_set(
+		buffer,
+		GEGL_RECTANGLE(area.x - layer.x, area.y - layer.y, area.width, area.height), 0,
+		format, &pixels[(gsize) (area.y - first_row) * width + area.x],
+		width * sizeof(*pixels)
+	);
+}
 
-	GtkWidget *toggle = gtk_check_button_new_with_label("Export alpha");
-	gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(toggle), options->export_alpha);
-	gtk_container_add(GTK_CONTAINER(vbox), toggle);
-	gtk_widget_show(toggle);
+// Writes the changed rows of a reload to the layer as one step that can be
+// undone, the same way filters change a drawable: through its shadow buffer,
+// which is merged with undo. Merging covers the whole layer, so the shadow
+// starts as a copy of it, and only the selected part is merged, so the
+// selection is put aside until the merge is done. pixels start at first_row
+// and is_changed has a flag for each of their rows.
+static bool qoi_watch_apply(QoiWatch *watch, QoiImage image, bool is_resized, guint32 first_row, const QoiPixel *pixels, const bool *is_changed) {
+	gimp_image_undo_group_start(watch->image);
 
-	GtkWidget *label = gtk_label_new("Colorspace:");
-	gtk_label_set_xalign(GTK_LABEL(label), 0);
-	gtk_container_add(GTK_CONTAINER(vbox), label);
-	gtk_widget_show(label);
+	if (is_resized) {
+		gimp_image_resize(watch->image, image.width, image.height, 0, 0);
+		gimp_layer_resize(watch->layer, image.width, image.height, 0, 0);
+		gimp_layer_set_offsets(watch->layer, 0, 0);
+	}
+	if (image.has_alpha && !gimp_drawable_has_alpha(watch->layer)) {
+		gimp_layer_add_alpha(watch->layer);
+	}
 
-	// As colorspaces are enumerated from 0, if the options are in the same
-	// order as they are in the enum, the active index will match the
-	// colorspace. If the values for colorspaces changes for future versions of
-	// the format, this can change to something more complicated.
-	GtkWidget *combo = gtk_combo_box_text_new();
-	gtk_combo_box_text_insert_text(GTK_COMBO_BOX_TEXT(combo), QOI_COLORSPACE_SRGB, "SRGB");
-	gtk_combo_box_text_insert_text(GTK_COMBO_BOX_TEXT(combo), QOI_COLORSPACE_LINEAR, "Linear");
+	gint32 selection = -1;
+	if (!gimp_selection_is_empty(watch->image)) {
+		selection = gimp_selection_save(watch->image);
+		gimp_selection_none(watch->image);
+	}
 
-	// Set one element as active so there is always a valid colorspace selected
-	gtk_combo_box_set_active(GTK_COMBO_BOX(combo), options->colorspace);
-	gtk_container_add(GTK_CONTAINER(vbox), combo);
-	gtk_widget_show(combo);
+	GeglBuffer *buffer  = gimp_drawable_get_buffer(watch->layer);
+	GeglBuffer *shadow  = gimp_drawable_get_shadow_buffer(watch->layer);
+	bool        success = buffer && shadow;
+	if (success) {
+		gegl_buffer_copy(buffer, 0, GEGL_ABYSS_NONE, shadow, 0);
 
-	gint response = gtk_dialog_run(GTK_DIALOG(dialog));
-	if (response == GTK_RESPONSE_CANCEL) {
-		export = GIMP_EXPORT_CANCEL;
+		// Rows that changed are sent in runs of consecutive rows.
+		const Babl *format       = babl_format(image.colorspace == QOI_COLORSPACE_LINEAR ? "RGBA u8" : "R~G~B~A u8");
+		guint32     changed_from = G_MAXUINT32;
+		for (guint32 y = first_row; y <= image.height; ++y) {
+			bool is_row_changed = y < image.height && is_changed[y - first_row];
+			if (is_row_changed && changed_from == G_MAXUINT32) {
+				changed_from = y;
+			} else if (!is_row_changed && changed_from != G_MAXUINT32) {
+				qoi_watch_transfer_rows(watch, shadow, format, image.width, changed_from, y, &pixels[(gsize) (changed_from - first_row) * image.width]);
+				changed_from = G_MAXUINT32;
+			}
+		}
+	}
+	if (shadow) {
+		g_object_unref(shadow);
+	}
+	if (buffer) {
+		g_object_unref(buffer);
 	}
 
-	options->export_alpha = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(toggle));
-	options->colorspace = gtk_combo_box_get_active(GTK_COMBO_BOX(combo));
+	if (success) {
+		gimp_drawable_merge_shadow(watch->layer, true);
+		gimp_drawable_update(watch->layer, 0, 0, gimp_drawable_width(watch->layer), gimp_drawable_height(watch->layer));
+	}
 
-	gtk_widget_destroy(dialog);
+	if (selection != -1) {
+		gimp_image_select_item(watch->image, GIMP_CHANNEL_OP_REPLACE, selection);
+		gimp_image_remove_channel(watch->image, selection);
+	}
 
-	gimp_set_data(SAVE_PROC, options, sizeof(*options));
+	gimp_image_undo_group_end(watch->image);
+	gimp_displays_flush();
 
-	return export;
+	return success;
 }
 
-static gint32 create_gimp_image_from_qoi_image(QoiImage qoi_image, const gchar *filename) {
-	// Layers only need to be deleted they are not added to an image. If they
-	// are added to an image, deleting the image will delete the layer as well.
-	// This is why gimp_item_delete is only called at one of the points of
-	// failure, when the layer fails to attach to the image.
+// Reads the changed file and decodes it from the last checkpoint before the
+// first byte that differs from the data that was read before. Only rows that
+// decode to different pixels are sent to the layer. A file that changes size
+// is decoded and sent in full, with the image and layer resized to match. So
+// is a file whose colorspace changes, as the same pixels then stand for
+// different colors in the layer.
+static bool qoi_watch_reload(QoiWatch *watch) {
+	gchar *data = 0;
+	gsize  size = 0;
 
-	gimp_progress_init("Transfering pixels");
-	gegl_init(0, 0);
+	QoiPhase previous = qoi_trace_enter(QOI_PHASE_IO);
+	bool     is_read  = g_file_get_contents(watch->filename, &data, &size, 0);
+	qoi_trace_enter(previous);
 
-	gint32 image = gimp_image_new(qoi_image.width, qoi_image.height, GIMP_RGB);
-	if (image == -1) {
-		gegl_exit();
-		return -1;
+	QoiImage image;
+	if (!is_read || !qoi_watch_parse_header(data, size, &image)) {
+		g_free(data);
+		return false;
 	}
 
-	gimp_image_set_filename(image, filename);
+	QoiImage old            = watch->qoi_image;
+	bool     is_resized     = image.width != old.width || image.height != old.height;
+	bool     is_reinterpret = image.colorspace != old.colorspace;
+	guint32  band_count     = qoi_watch_band_count(image);
+	guint32  first_band     = 0;
 
-	gint32 layer = gimp_layer_new(
-		image,
-		"Background",
-		qoi_image.width, qoi_image.height,
-		qoi_image.has_alpha ? GIMP_RGBA_IMAGE : GIMP_RGB_IMAGE,
-		100, GIMP_NORMAL_MODE
-	);
-	if (layer == -1) {
-		gimp_image_delete(image);
-		gegl_exit();
-		return -1;
+	QoiCheckpoint *checkpoints = g_try_new(QoiCheckpoint, band_count);
+	if (!checkpoints) {
+		g_free(data);
+		return false;
 	}
 
-	if (!gimp_image_insert_layer(image, layer, 0, 0)) {
-		gimp_item_delete(layer);
-		gimp_image_delete(image);
-		gegl_exit();
-		return -1;
-	}
+	if (is_resized || is_reinterpret || image.has_alpha != old.has_alpha) {
+		checkpoints[0].data_index = QOI_HEADER_SIZE;
+		qoi_decoder_begin(&checkpoints[0].decoder, image.width, image.has_alpha, 0);
+	} else {
+		gsize common = 0;
+		gsize limit  = MIN(size, watch->size);
+		while (common < limit && data[common] == watch->data[common]) {
+			++common;
+		}
 
-	GeglBuffer *buffer = gimp_drawable_get_buffer(layer);
-	if (!buffer) {
-		gimp_image_delete(image);
-		gegl_exit();
-		return -1;
+		// Everything before the checkpoint of a band is the same in both
+		// files, so decoding the band starts from the same state.
+		while (first_band + 1 < band_count && watch->checkpoints[first_band + 1].data_index <= common) {
+			++first_band;
+		}
+		memcpy(checkpoints, watch->checkpoints, (first_band + 1) * sizeof(*checkpoints));
 	}
 
-	const Babl *format = 0;
-	switch (qoi_image.colorspace) {
-		case QOI_COLORSPACE_SRGB: format = babl_format("R~G~B~A u8"); break;
-		case QOI_COLORSPACE_LINEAR: format = babl_format("RGBA u8"); break;
-		default: assert(!"Not reached!"); break;
+	guint32   first_row = first_band * QOI_WATCH_BAND_HEIGHT;
+	gsize     row_size  = (gsize) image.width * sizeof(QoiPixel);
+	QoiPixel *pixels    = g_try_malloc((image.height - first_row) * row_size);
+
+	qoi_trace_enter(QOI_PHASE_DECODE);
+	if (!pixels || !qoi_watch_decode(data, size, image, first_band, checkpoints, pixels)) {
+		g_free(pixels);
+		g_free(checkpoints);
+		g_free(data);
+		return false;
 	}
 
-	// It is faster to do a single call to gegl_buffer_set, but to give users
-	// some feedback on what is happening, one call per row of pixels is perforemed and
-	// the progress is updated after each.
-	for (guint32 y = 0; y < qoi_image.height; ++y) {
-		// This procedure doesn't indicate if it fails, it just doesn't put any pixels in the image.
-		gegl_buffer_set(
-			buffer,
-			GEGL_RECTANGLE(0, y, qoi_image.width, 1), 0,
-			format, &qoi_image.pixels[y * qoi_image.width],
-			GEGL_AUTO_ROWSTRIDE
+	bool *is_changed  = g_new(bool, image.height - first_row);
+	bool  has_changes = false;
+	for (guint32 y = first_row; y < image.height; ++y) {
+		is_changed[y - first_row] = (
+			is_resized || is_reinterpret ||
+			memcmp(&pixels[(gsize) (y - first_row) * image.width], &old.pixels[(gsize) y * image.width], row_size) != 0
 		);
-		gimp_progress_update((gdouble) y / (gdouble) qoi_image.height);
+		has_changes = has_changes || is_changed[y - first_row];
 	}
-	g_object_unref(buffer);
 
-	gegl_exit();
-	gimp_progress_end();
+	qoi_trace_enter(QOI_PHASE_TRANSFER);
+	bool success = !has_changes || qoi_watch_apply(watch, image, is_resized, first_row, pixels, is_changed);
+	g_free(is_changed);
 
-	return image;
+	if (!success) {
+		g_free(pixels);
+		g_free(checkpoints);
+		g_free(data);
+		return false;
+	}
+
+	// Everything before the first decoded row is the same as before, the
+	// rest is replaced with what was decoded.
+	if (is_resized) {
+		g_free(old.pixels);
+		watch->qoi_image.pixels = pixels;
+	} else {
+		memcpy(&old.pixels[(gsize) first_row * image.width], pixels, (image.height - first_row) * row_size);
+		g_free(pixels);
+	}
+	watch->qoi_image.width          = image.width;
+	watch->qoi_image.height         = image.height;
+	watch->qoi_image.content_width  = image.width;
+	watch->qoi_image.content_height = image.height;
+	watch->qoi_image.colorspace     = image.colorspace;
+	watch->qoi_image.has_alpha      = image.has_alpha;
+
+	g_free(watch->checkpoints);
+	g_free(watch->data);
+	watch->checkpoints = checkpoints;
+	watch->data        = data;
+	watch->size        = size;
+
+	return true;
 }
 
-static bool get_qoi_image_from_gimp(gint32 drawable, QoiExportOptions options, QoiImage *result) {
-	gimp_progress_init("Transfering pixels");
+static gboolean qoi_watch_poll(gpointer data) {
+	QoiWatch *watch = data;
 
-	result->colorspace = options.colorspace;
-	result->has_alpha = options.export_alpha;
+	if (!gimp_image_is_valid(watch->image) || !gimp_item_is_valid(watch->layer)) {
+		watch->poll_source = 0;
+		g_main_loop_quit(watch->loop);
+		return G_SOURCE_REMOVE;
+	}
 
-	gegl_init(0, 0);
+	QoiFileStamp stamp;
+	if (!qoi_file_stamp(watch->filename, &stamp)) {
+		return G_SOURCE_CONTINUE;
+	}
 
-	GeglBuffer *buffer = gimp_drawable_get_buffer(drawable);
-	if (!buffer) {
-		gegl_exit();
-		return false;
+	if (memcmp(&stamp, &watch->stamp, sizeof(stamp)) != 0) {
+		watch->stamp       = stamp;
+		watch->is_changing = true;
+		return G_SOURCE_CONTINUE;
 	}
 
-	result->width = gegl_buffer_get_width(buffer);
-	result->height = gegl_buffer_get_height(buffer);
+	if (watch->is_changing) {
+		watch->is_changing = false;
 
-	result->pixels = g_try_malloc(result->width * result->height * sizeof(*result->pixels));
-	if (!result->pixels) {
-		g_object_unref(buffer);
-		gegl_exit();
+		QoiTrace trace;
+		bool     is_traced = qoi_trace_is_enabled();
+		if (is_traced) {
+			qoi_trace_begin(&trace);
+			qoi_trace_activate(&trace);
+		}
+
+		bool success = qoi_watch_reload(watch);
+
+		if (is_traced) {
+			qoi_trace_finish(&trace, "reload", watch->filename, watch->qoi_image.width, watch->qoi_image.height, success);
+			qoi_trace_activate(0);
+		}
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+static gboolean qoi_watch_stop(gpointer data) {
+	QoiWatch *watch = data;
+	watch->stop_source = 0;
+	g_main_loop_quit(watch->loop);
+	return G_SOURCE_REMOVE;
+}
+
+// Watches filename until the image or the layer is closed, or for duration
+// seconds when it isn't 0, checking it for changes every interval
+// milliseconds. Doesn't return before watching stops. The layer has to hold
+// the pixels of the file when watching starts, as it does right after the
+// file has been loaded without turning it.
+static bool watch(gint32 image, gint32 layer, const gchar *filename, guint interval, guint duration) {
+	QoiWatch watch = {
+		.image    = image,
+		.layer    = layer,
+		.filename = g_strdup(filename),
+	};
+
+	if (
+		!qoi_file_stamp(filename, &watch.stamp) ||
+		!g_file_get_contents(filename, &watch.data, &watch.size, 0) ||
+		!qoi_watch_parse_header(watch.data, watch.size, &watch.qoi_image)
+	) {
+		g_message("'%s' can't be watched, it is not a QOI file.", filename);
+		g_free(watch.data);
+		g_free(watch.filename);
 		return false;
 	}
 
-	const Babl *format = 0;
-	switch (options.colorspace) {
-		case QOI_COLORSPACE_SRGB: format = babl_format("R~G~B~A u8"); break;
-		case QOI_COLORSPACE_LINEAR: format = babl_format("RGBA u8"); break;
-		default: assert(!"Not reached!"); break;
+	QoiImage image_info = watch.qoi_image;
+	watch.checkpoints      = g_try_new(QoiCheckpoint, qoi_watch_band_count(image_info));
+	watch.qoi_image.pixels = g_try_malloc((gsize) image_info.width * image_info.height * sizeof(QoiPixel));
+
+	bool success = watch.checkpoints && watch.qoi_image.pixels;
+	if (success) {
+		watch.checkpoints[0].data_index = QOI_HEADER_SIZE;
+		qoi_decoder_begin(&watch.checkpoints[0].decoder, image_info.width, image_info.has_alpha, 0);
+		success = qoi_watch_decode(watch.data, watch.size, image_info, 0, watch.checkpoints, watch.qoi_image.pixels);
 	}
 
-	// It is faster to do a single call to gegl_buffer_get, but to give users
-	// some feedback on what is happening, one call per row of pixels is perforemed and
-	// the progress is updated after each.
-	for (guint32 y = 0; y < result->height; ++y) {
-		// This procedure doesn't indicate if it fails, it just doesn't put any pixels in the image.
-		gegl_buffer_get(
-			buffer,
-			GEGL_RECTANGLE(0, y, result->width, 1), 1,
-			format, &result->pixels[y * result->width],
-			GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE
-		);
-		gimp_progress_update((gdouble) y / (gdouble) result->height);
+	if (success) {
+		gimp_progress_init_printf("Watching '%s' for changes", filename);
+
+		watch.loop = g_main_loop_new(0, false);
+		watch.poll_source = g_timeout_add(interval, qoi_watch_poll, &watch);
+		if (duration != 0) {
+			watch.stop_source = g_timeout_add_seconds(duration, qoi_watch_stop, &watch);
+		}
+		g_main_loop_run(watch.loop);
+
+		// The source that didn't end the loop is still attached.
+		if (watch.poll_source != 0) {
+			g_source_remove(watch.poll_source);
+		}
+		if (watch.stop_source != 0) {
+			g_source_remove(watch.stop_source);
+		}
+		g_main_loop_unref(watch.loop);
+	} else {
+		g_message("'%s' can't be watched, it could not be decoded.", filename);
 	}
-	g_object_unref(buffer);
 
-	gegl_exit();
-	gimp_progress_end();
+	g_free(watch.qoi_image.pixels);
+	g_free(watch.checkpoints);
+	g_free(watch.data);
+	g_free(watch.filename);
 
-	return true;
+	return success;
 }
 
 static void query() {
 	static const GimpParamDef load_args[] = {
-		{ GIMP_PDB_INT32,    "run_mode",     "Run mode" },
-		{ GIMP_PDB_STRING,   "filename",     "The name of the file to load" },
-		{ GIMP_PDB_STRING,   "raw_filename", "The name entered" },
+		{ GIMP_PDB_INT32,    "run_mode",      "Run mode" },
+		{ GIMP_PDB_STRING,   "filename",      "The name of the file to load" },
+		{ GIMP_PDB_STRING,   "raw_filename",  "The name entered" },
+		{ GIMP_PDB_INT32,    "autocrop",      "Crop the layer to the non-transparent pixels, files without alpha are not cropped (TRUE or FALSE)" },
+		{ GIMP_PDB_INT32,    "image_mode",    "Image mode { RGB (0), grayscale or indexed when possible (1) }" },
+		{ GIMP_PDB_INT32,    "cache_size",    "Size in MiB of the shared cache of decoded images (0 to disable)" },
+		{ GIMP_PDB_INT32,    "precision",     "Precision { 8-bit (0), 16-bit linear (1), 16-bit perceptual (2), float linear (3), float perceptual (4) }" },
+		{ GIMP_PDB_INT32,    "orientation",   "Turn the image { none (0), flip horizontally (1), flip vertically (2), rotate 90 (3), rotate 180 (4), rotate 270 (5) }" },
+		{ GIMP_PDB_INT32,    "unpremultiply", "The colors in the file are premultiplied by alpha (TRUE or FALSE)" },
 	};
 
 	static const GimpParamDef load_return_vals[] = {
@@ -671,12 +4597,34 @@ static void query() {
 		{ GIMP_PDB_DRAWABLE, "drawable",     "Drawable to save" },
 		{ GIMP_PDB_STRING,   "filename",     "The name of the file to load" },
 		{ GIMP_PDB_STRING,   "raw_filename", "The name entered" },
+		{ GIMP_PDB_INT32,    "verify",       "Decode the written file and fail when it differs from the image (TRUE or FALSE)" },
+		{ GIMP_PDB_INT32,    "orientation",  "Turn the image { none (0), flip horizontally (1), flip vertically (2), rotate 90 (3), rotate 180 (4), rotate 270 (5) }" },
+		{ GIMP_PDB_INT32,    "premultiply",  "Premultiply the colors by alpha (TRUE or FALSE)" },
+		{ GIMP_PDB_INT32,    "canvas_size",  "Export layers at the size of the canvas instead of their own size (TRUE or FALSE)" },
+	};
+
+	static const GimpParamDef batch_export_args[] = {
+		{ GIMP_PDB_INT32,       "run_mode",       "Run mode" },
+		{ GIMP_PDB_INT32,       "num_drawables",  "Number of drawables" },
+		{ GIMP_PDB_INT32ARRAY,  "drawables",      "Drawables to save" },
+		{ GIMP_PDB_INT32,       "num_filenames",  "Number of filenames" },
+		{ GIMP_PDB_STRINGARRAY, "filenames",      "The names of the files to save to" },
+		{ GIMP_PDB_INT32,       "export_alpha",   "Export alpha (TRUE or FALSE)" },
+		{ GIMP_PDB_INT32,       "colorspace",     "Colorspace { SRGB (0), Linear (1) }" },
+		{ GIMP_PDB_INT32,       "memory_limit",   "Maximum MiB of pixels in flight" },
+		{ GIMP_PDB_INT32,       "max_size",       "Maximum width or height, larger images are scaled down (0 for full size)" },
+		{ GIMP_PDB_INT32,       "verify",         "Decode the written files and fail when they differ from the drawables (TRUE or FALSE)" },
+		{ GIMP_PDB_INT32,       "dedup",          "Drawables with the same pixels as an earlier one { encode again (0), reflink or copy (1), hard link (2) }" },
+		{ GIMP_PDB_INT32,       "orientation",    "Turn the images { none (0), flip horizontally (1), flip vertically (2), rotate 90 (3), rotate 180 (4), rotate 270 (5) }" },
+		{ GIMP_PDB_INT32,       "premultiply",    "Premultiply the colors by alpha (TRUE or FALSE)" },
 	};
 
 	gimp_install_procedure(
 		LOAD_PROC,
 		"Loads Quite OK Image (QOI) files",
-		"Loads Quite OK Image (QOI) files",
+		"Loads Quite OK Image (QOI) files. Files opened interactively are "
+		"loaded with the default options, the others are only available as "
+		"parameters.",
 		0,
 		0,
 		DATE,
@@ -704,6 +4652,89 @@ static void query() {
 	);
 	gimp_register_file_handler_mime(SAVE_PROC, "image/qoi");
 	gimp_register_save_handler(SAVE_PROC, "qoi", "");
+
+	static const GimpParamDef benchmark_args[] = {
+		{ GIMP_PDB_INT32,       "run_mode",       "Run mode" },
+		{ GIMP_PDB_INT32,       "max_size",       "Width of the largest synthetic image (0 for the default)" },
+		{ GIMP_PDB_INT32,       "repeats",        "Number of times every case runs (0 for the default)" },
+		{ GIMP_PDB_INT32,       "count_events",   "Count cycles, instructions, branch and cache misses and page faults of each phase (TRUE or FALSE)" },
+	};
+
+	static const GimpParamDef benchmark_return_vals[] = {
+		{ GIMP_PDB_STRING,      "report",         "One line of JSON for every run with its timings" },
+	};
+
+	gimp_install_procedure(
+		BATCH_EXPORT_PROC,
+		"Saves several drawables as Quite OK Image (QOI) files",
+		"Saves each drawable to the file with the same index. Pixels are "
+		"fetched one drawable at a time while the files are encoded and "
+		"written in parallel. At most memory_limit MiB of fetched pixels "
+		"are kept in memory at once, 0 picks a default. Drawables whose "
+		"pixels match an earlier drawable in the batch can reuse its file "
+		"instead of being encoded again.",
+		0,
+		0,
+		DATE,
+		0,
+		0,
+		GIMP_PLUGIN,
+		G_N_ELEMENTS(batch_export_args), 0,
+		batch_export_args, 0
+	);
+
+	gimp_install_procedure(
+		BENCHMARK_PROC,
+		"Measures loading and saving of QOI files in this GIMP",
+		"Creates synthetic images of a few sizes and loads and saves them "
+		"through the same code as the load and save procedures, including "
+		"the transfer of pixels to and from GIMP. Every variant of loading "
+		"and saving is run repeats times. The report has the time spent in "
+		"each phase of every run, in the format of the QOI_TRACE lines. "
+		"PNG, WebP and PAM are run through the same transfers as baselines, "
+		"PNG and WebP only when the plug-in was built with their libraries. "
+		"With count_events, the CPU events of each phase are counted with "
+		"perf_event_open where the system allows it.",
+		0,
+		0,
+		DATE,
+		0,
+		0,
+		GIMP_PLUGIN,
+		G_N_ELEMENTS(benchmark_args), G_N_ELEMENTS(benchmark_return_vals),
+		benchmark_args, benchmark_return_vals
+	);
+
+	static const GimpParamDef watch_args[] = {
+		{ GIMP_PDB_INT32,       "run_mode",       "Run mode" },
+		{ GIMP_PDB_IMAGE,       "image",          "Image that was loaded from the file" },
+		{ GIMP_PDB_DRAWABLE,    "drawable",       "Layer that holds the pixels of the file" },
+		{ GIMP_PDB_STRING,      "filename",       "The name of the file to watch (empty for the file of the image)" },
+		{ GIMP_PDB_INT32,       "interval",       "Milliseconds between checks of the file (0 for the default)" },
+		{ GIMP_PDB_INT32,       "duration",       "Seconds to watch the file for (0 to watch until the image is closed)" },
+	};
+
+	gimp_install_procedure(
+		WATCH_PROC,
+		"Reloads a QOI file into its layer whenever it changes",
+		"Checks the file every interval milliseconds until the image or the "
+		"layer is closed, or until duration seconds have passed when it isn't "
+		"0. The call doesn't return before watching stops, so scripts that "
+		"need to go on should pass a duration. When the file has changed, decoding resumes from "
+		"the last band of rows before the first byte that differs and only "
+		"the rows whose pixels changed are updated in the layer. The layer "
+		"has to hold the pixels of the file when watching starts, turned "
+		"files and files inside of archives can't be watched.",
+		0,
+		0,
+		DATE,
+		"_Watch QOI File for Changes",
+		"RGB*, GRAY*, INDEXED*",
+		GIMP_PLUGIN,
+		G_N_ELEMENTS(watch_args), 0,
+		watch_args, 0
+	);
+	gimp_plugin_menu_register(WATCH_PROC, "<Image>/File");
 }
 
 static void run(
@@ -719,12 +4750,92 @@ static void run(
 	*return_vals = values;
 	*nreturn_vals = 1;
 
+	gegl_init(0, 0);
+
 	if (strcmp(name, LOAD_PROC) == 0 && nparams >= 2) {
-		gchar *filename = params[1].data.d_string;
+		GimpRunMode run_mode = params[0].data.d_int32;
+		gchar      *filename = params[1].data.d_string;
 
-		QoiImage qoi_image;
-		if (load_image(filename, &qoi_image)) {
-			gint32 image = create_gimp_image_from_qoi_image(qoi_image, filename);
+		QoiLoadOptions options = {
+			.autocrop = false,
+			.mode = QOI_LOAD_MODE_RGB,
+			.cache_size = 0,
+			.precision = QOI_LOAD_PRECISION_U8,
+			.orientation = QOI_ORIENTATION_NONE,
+			.unpremultiply = false,
+		};
+
+		switch (run_mode) {
+			case GIMP_RUN_NONINTERACTIVE: {
+				if (nparams >= 4) {
+					options.autocrop = params[3].data.d_int32 != 0;
+				}
+				if (nparams >= 5 && params[4].data.d_int32 >= 0 && params[4].data.d_int32 < QOI_LOAD_MODE_COUNT) {
+					options.mode = params[4].data.d_int32;
+				}
+				if (nparams >= 6) {
+					options.cache_size = MAX(params[5].data.d_int32, 0);
+				}
+				if (nparams >= 7 && params[6].data.d_int32 >= 0 && params[6].data.d_int32 < QOI_LOAD_PRECISION_COUNT) {
+					options.precision = params[6].data.d_int32;
+				}
+				if (nparams >= 8 && params[7].data.d_int32 >= 0 && params[7].data.d_int32 < QOI_ORIENTATION_COUNT) {
+					options.orientation = params[7].data.d_int32;
+				}
+				if (nparams >= 9) {
+					options.unpremultiply = params[8].data.d_int32 != 0;
+				}
+				gimp_set_data(LOAD_PROC, &options, sizeof(options));
+			} break;
+			case GIMP_RUN_WITH_LAST_VALS: {
+				gimp_get_data(LOAD_PROC, &options);
+			} break;
+			// Opening files from the file dialog, by dropping them or several
+			// at once doesn't ask for anything, like the loaders of other
+			// simple formats. The options are only on the parameters.
+			case GIMP_RUN_INTERACTIVE: break;
+		}
+
+		QoiImage       qoi_image     = { 0 };
+		QoiDecodeStats stats;
+		GMappedFile   *cache_mapping = 0;
+		guint64        cache_limit   = (guint64) options.cache_size * 1024 * 1024;
+
+		QoiTrace trace;
+		bool     is_traced = qoi_trace_is_enabled();
+		if (is_traced) {
+			qoi_trace_begin(&trace);
+			qoi_trace_activate(&trace);
+		}
+
+		bool is_loaded = false;
+		if (cache_limit != 0) {
+			qoi_trace_enter(QOI_PHASE_IO);
+			cache_mapping = qoi_cache_lookup(filename, &qoi_image, &stats);
+			is_loaded = cache_mapping != 0;
+		}
+		if (!is_loaded) {
+			qoi_trace_enter(QOI_PHASE_DECODE);
+			is_loaded = load_image(filename, &qoi_image, &stats);
+			if (is_loaded && cache_limit != 0) {
+				qoi_trace_enter(QOI_PHASE_IO);
+				qoi_cache_store(filename, qoi_image, &stats, cache_limit);
+			}
+		}
+
+		if (is_loaded) {
+			qoi_trace_enter(QOI_PHASE_TRANSFER);
+
+			GeglRectangle crop = { 0, 0, qoi_image.width, qoi_image.height };
+			if (options.autocrop && qoi_image.has_alpha && stats.min_x <= stats.max_x) {
+				crop = (GeglRectangle) {
+					stats.min_x, stats.min_y,
+					stats.max_x - stats.min_x + 1, stats.max_y - stats.min_y + 1,
+				};
+			}
+
+			GimpImageBaseType base_type = choose_base_type(qoi_image, &stats, options.mode, options.precision);
+			gint32 image = create_gimp_image_from_qoi_image(qoi_image, crop, base_type, options, &stats, filename);
 			if (image != -1) {
 				values[0].data.d_status = GIMP_PDB_SUCCESS;
 				values[1].type = GIMP_PDB_IMAGE;
@@ -733,7 +4844,16 @@ static void run(
 			}
 		}
 
-		g_free(qoi_image.pixels);
+		if (is_traced) {
+			qoi_trace_finish(&trace, "load", filename, qoi_image.width, qoi_image.height, values[0].data.d_status == GIMP_PDB_SUCCESS);
+			qoi_trace_activate(0);
+		}
+
+		if (cache_mapping) {
+			g_mapped_file_unref(cache_mapping);
+		} else {
+			g_free(qoi_image.pixels);
+		}
 	} else if (strcmp(name, SAVE_PROC) == 0 && nparams >= 4) {
 		GimpRunMode run_mode = params[0].data.d_int32;
 		gint32      image    = params[1].data.d_image;
@@ -744,10 +4864,28 @@ static void run(
 		QoiExportOptions options = {
 			.export_alpha = true,
 			.colorspace = QOI_COLORSPACE_SRGB,
+			.max_size = 0,
+			.verify = false,
+			.orientation = QOI_ORIENTATION_NONE,
+			.premultiply = false,
+			.canvas_size = true,
 		};
 
 		switch (run_mode) {
-			case GIMP_RUN_NONINTERACTIVE: break;
+			// Scripts that don't ask for the canvas size get layers at their
+			// own size, as they did before layers were placed on the canvas.
+			case GIMP_RUN_NONINTERACTIVE: {
+				if (nparams >= 6) {
+					options.verify = params[5].data.d_int32 != 0;
+				}
+				options.canvas_size = nparams >= 9 && params[8].data.d_int32 != 0;
+				if (nparams >= 7 && params[6].data.d_int32 >= 0 && params[6].data.d_int32 < QOI_ORIENTATION_COUNT) {
+					options.orientation = params[6].data.d_int32;
+				}
+				if (nparams >= 8) {
+					options.premultiply = params[7].data.d_int32 != 0;
+				}
+			} break;
 			case GIMP_RUN_WITH_LAST_VALS: {
 				gimp_get_data(SAVE_PROC, &options);
 			} break;
@@ -761,18 +4899,128 @@ static void run(
 			return;
 		}
 
-		QoiImage qoi_image;
-		if (get_qoi_image_from_gimp(drawable, options, &qoi_image)) {
-			if (save_image(qoi_image, filename)) {
+		// The export dialog leaves images that the plug-in can composite
+		// itself to be composited here instead of merging them.
+		bool is_legacy = false;
+		bool composite = (
+			run_mode == GIMP_RUN_INTERACTIVE &&
+			export == GIMP_EXPORT_IGNORE &&
+			!is_single_plain_layer(image, drawable) &&
+			can_composite_layers(image, &is_legacy)
+		);
+
+		QoiTrace trace;
+		bool     is_traced = qoi_trace_is_enabled();
+		if (is_traced) {
+			qoi_trace_begin(&trace);
+			qoi_trace_activate(&trace);
+		}
+
+		QoiImage qoi_image = { 0 };
+		qoi_trace_enter(QOI_PHASE_TRANSFER);
+		bool is_fetched = composite ?
+			get_qoi_image_from_layers(image, options, is_legacy, &qoi_image) :
+			get_qoi_image_from_gimp(image, drawable, options, &qoi_image);
+		if (is_fetched) {
+			qoi_trace_enter(QOI_PHASE_ENCODE);
+			if (save_image(qoi_image, filename, true, options.verify)) {
 				values[0].data.d_status = GIMP_PDB_SUCCESS;
 			}
 		}
 
+		if (is_traced) {
+			qoi_trace_finish(&trace, "save", filename, qoi_image.width, qoi_image.height, values[0].data.d_status == GIMP_PDB_SUCCESS);
+			qoi_trace_activate(0);
+		}
+
 		g_free(qoi_image.pixels);
 
 		if (export == GIMP_EXPORT_EXPORT) {
 			gimp_image_delete(image);
 		}
+	} else if (strcmp(name, BATCH_EXPORT_PROC) == 0 && nparams >= 9) {
+		gint    drawable_count = params[1].data.d_int32;
+		gint32 *drawables      = params[2].data.d_int32array;
+		gint    filename_count = params[3].data.d_int32;
+		gchar **filenames      = params[4].data.d_stringarray;
+		guint64 memory_limit   = params[7].data.d_int32 > 0 ? params[7].data.d_int32 : BATCH_EXPORT_DEFAULT_MEMORY_LIMIT;
+
+		QoiExportOptions options = {
+			.export_alpha = params[5].data.d_int32 != 0,
+			.colorspace = params[6].data.d_int32,
+			.max_size = MAX(params[8].data.d_int32, 0),
+			.verify = nparams >= 10 && params[9].data.d_int32 != 0,
+			.orientation = nparams >= 12 ? params[11].data.d_int32 : QOI_ORIENTATION_NONE,
+			.premultiply = nparams >= 13 && params[12].data.d_int32 != 0,
+			.canvas_size = true,
+		};
+
+		if (
+			drawable_count != filename_count ||
+			options.colorspace >= QOI_COLORSPACE_COUNT ||
+			options.orientation >= QOI_ORIENTATION_COUNT
+		) {
+			values[0].data.d_status = GIMP_PDB_CALLING_ERROR;
+			return;
+		}
+
+		QoiDedupMode dedup = QOI_DEDUP_NONE;
+		if (nparams >= 11 && params[10].data.d_int32 >= 0 && params[10].data.d_int32 < QOI_DEDUP_COUNT) {
+			dedup = params[10].data.d_int32;
+		}
+
+		if (batch_export(drawables, filenames, drawable_count, options, memory_limit * 1024 * 1024, dedup)) {
+			values[0].data.d_status = GIMP_PDB_SUCCESS;
+		}
+	} else if (strcmp(name, BENCHMARK_PROC) == 0 && nparams >= 1) {
+		GimpRunMode run_mode     = params[0].data.d_int32;
+		guint32     max_size     = BENCHMARK_DEFAULT_MAX_SIZE;
+		guint32     repeats      = BENCHMARK_DEFAULT_REPEATS;
+		bool        count_events = nparams >= 4 && params[3].data.d_int32 != 0;
+
+		if (nparams >= 2 && params[1].data.d_int32 > 0) {
+			max_size = MIN(params[1].data.d_int32, GIMP_MAX_IMAGE_SIZE);
+		}
+		if (nparams >= 3 && params[2].data.d_int32 > 0) {
+			repeats = params[2].data.d_int32;
+		}
+
+		gchar *report = benchmark(max_size, repeats, count_events, run_mode == GIMP_RUN_INTERACTIVE);
+		if (report) {
+			values[0].data.d_status = GIMP_PDB_SUCCESS;
+			values[1].type = GIMP_PDB_STRING;
+			values[1].data.d_string = report;
+			*nreturn_vals = 2;
+		}
+	} else if (strcmp(name, WATCH_PROC) == 0 && nparams >= 3) {
+		gint32 image    = params[1].data.d_image;
+		gint32 layer    = params[2].data.d_drawable;
+		guint  interval = WATCH_DEFAULT_INTERVAL;
+		guint  duration = 0;
+
+		gchar *filename = 0;
+		if (nparams >= 4 && params[3].data.d_string && params[3].data.d_string[0] != 0) {
+			filename = g_strdup(params[3].data.d_string);
+		} else {
+			filename = gimp_image_get_filename(image);
+		}
+		if (nparams >= 5 && params[4].data.d_int32 > 0) {
+			interval = params[4].data.d_int32;
+		}
+		if (nparams >= 6 && params[5].data.d_int32 > 0) {
+			duration = params[5].data.d_int32;
+		}
+
+		if (!filename || !gimp_item_is_layer(layer)) {
+			values[0].data.d_status = GIMP_PDB_CALLING_ERROR;
+			g_free(filename);
+			return;
+		}
+
+		if (watch(image, layer, filename, interval, duration)) {
+			values[0].data.d_status = GIMP_PDB_SUCCESS;
+		}
+		g_free(filename);
 	}
 }
 